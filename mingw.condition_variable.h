@@ -0,0 +1,200 @@
+/**
+* @file mingw.condition_variable.h
+* @brief std::condition_variable and std::condition_variable_any for MinGW's
+* win32 thread model, to go with mingw.mutex.h and mingw.shared_mutex.h.
+*
+* This isn't the mingw-std-threads version of this header. It covers the
+* subset of the standard interface that's needed here, on Windows Vista or
+* later, and works with any of the mutexes mingw.mutex.h provides.
+*/
+
+#ifndef MINGW_CONDITIONAL_VARIABLE_H
+#define MINGW_CONDITIONAL_VARIABLE_H
+
+#if !defined(__cplusplus) || (__cplusplus < 201103L)
+#error A C++11 compiler is required!
+#endif
+
+#include <chrono>
+#include <system_error>
+#include <mutex>
+#include <condition_variable>
+
+#include <windows.h>
+
+#include "mingw.mutex.h"
+
+#if !defined(_WIN32_WINNT) || (_WIN32_WINNT < 0x0600)
+#error To use mingw.condition_variable.h, you will need to define the macro _WIN32_WINNT to be 0x0600 (Windows Vista) or higher.
+#endif
+
+namespace mingw_stdthread
+{
+enum class cv_status { no_timeout, timeout };
+
+//    Waits on a native condition variable, using a critical section of its own
+//  rather than the caller's lock, so that it works whatever the lock is. The
+//  caller's lock is only released once we hold the critical section, and
+//  sleeping releases that atomically, so a notify made under the caller's lock
+//  can't slip in between the two and be lost.
+class condition_variable_any
+{
+    CRITICAL_SECTION mMutex;
+    CONDITION_VARIABLE mCond;
+
+    template<class L>
+    bool wait_native (L& lock, DWORD timeout)
+    {
+        EnterCriticalSection(&mMutex);
+        lock.unlock();
+
+        BOOL woken = SleepConditionVariableCS(&mCond, &mMutex, timeout);
+        DWORD err = woken ? 0 : GetLastError();
+
+        LeaveCriticalSection(&mMutex);
+        lock.lock();
+
+        if (!woken && err != ERROR_TIMEOUT)
+            throw std::system_error(err, std::system_category());
+
+        return woken;
+    }
+public:
+    typedef PCONDITION_VARIABLE native_handle_type;
+
+    condition_variable_any (void)
+    {
+        InitializeCriticalSection(&mMutex);
+        InitializeConditionVariable(&mCond);
+    }
+    condition_variable_any (const condition_variable_any&) = delete;
+    condition_variable_any& operator= (const condition_variable_any&) = delete;
+    ~condition_variable_any (void)
+    {
+        DeleteCriticalSection(&mMutex);
+    }
+
+    void notify_one (void) noexcept
+    {
+        EnterCriticalSection(&mMutex);
+        WakeConditionVariable(&mCond);
+        LeaveCriticalSection(&mMutex);
+    }
+    void notify_all (void) noexcept
+    {
+        EnterCriticalSection(&mMutex);
+        WakeAllConditionVariable(&mCond);
+        LeaveCriticalSection(&mMutex);
+    }
+
+    template<class L>
+    void wait (L& lock)
+    {
+        wait_native(lock, INFINITE);
+    }
+    template<class L, class Predicate>
+    void wait (L& lock, Predicate pred)
+    {
+        while (!pred())
+            wait(lock);
+    }
+
+    template<class L, class Rep, class Period>
+    cv_status wait_for (L& lock, const std::chrono::duration<Rep, Period>& rel_time)
+    {
+        using namespace std::chrono;
+        auto ms = duration_cast<milliseconds>(rel_time).count();
+
+        if (ms < 0)
+            ms = 0;
+        else if (ms >= (decltype(ms))INFINITE)
+            ms = INFINITE - 1;
+
+        return wait_native(lock, (DWORD)ms) ? cv_status::no_timeout : cv_status::timeout;
+    }
+    template<class L, class Rep, class Period, class Predicate>
+    bool wait_for (L& lock, const std::chrono::duration<Rep, Period>& rel_time, Predicate pred)
+    {
+        return wait_until(lock, std::chrono::steady_clock::now() + rel_time, pred);
+    }
+
+    template<class L, class Clock, class Duration>
+    cv_status wait_until (L& lock, const std::chrono::time_point<Clock, Duration>& abs_time)
+    {
+        auto now = Clock::now();
+
+        if (abs_time > now)
+            wait_for(lock, abs_time - now);
+
+        return Clock::now() < abs_time ? cv_status::no_timeout : cv_status::timeout;
+    }
+    template<class L, class Clock, class Duration, class Predicate>
+    bool wait_until (L& lock, const std::chrono::time_point<Clock, Duration>& abs_time, Predicate pred)
+    {
+        while (!pred())
+        {
+            if (wait_until(lock, abs_time) == cv_status::timeout)
+                return pred();
+        }
+        return true;
+    }
+
+    native_handle_type native_handle (void)
+    {
+        return &mCond;
+    }
+};
+
+//    The standard only asks condition_variable to work with unique_lock<mutex>,
+//  which the general version above does just as well.
+class condition_variable : condition_variable_any
+{
+public:
+    using condition_variable_any::native_handle_type;
+    using condition_variable_any::notify_one;
+    using condition_variable_any::notify_all;
+    using condition_variable_any::native_handle;
+
+    void wait (std::unique_lock<mutex>& lock)
+    {
+        condition_variable_any::wait(lock);
+    }
+    template<class Predicate>
+    void wait (std::unique_lock<mutex>& lock, Predicate pred)
+    {
+        condition_variable_any::wait(lock, pred);
+    }
+    template<class Rep, class Period>
+    cv_status wait_for (std::unique_lock<mutex>& lock, const std::chrono::duration<Rep, Period>& rel_time)
+    {
+        return condition_variable_any::wait_for(lock, rel_time);
+    }
+    template<class Rep, class Period, class Predicate>
+    bool wait_for (std::unique_lock<mutex>& lock, const std::chrono::duration<Rep, Period>& rel_time, Predicate pred)
+    {
+        return condition_variable_any::wait_for(lock, rel_time, pred);
+    }
+    template<class Clock, class Duration>
+    cv_status wait_until (std::unique_lock<mutex>& lock, const std::chrono::time_point<Clock, Duration>& abs_time)
+    {
+        return condition_variable_any::wait_until(lock, abs_time);
+    }
+    template<class Clock, class Duration, class Predicate>
+    bool wait_until (std::unique_lock<mutex>& lock, const std::chrono::time_point<Clock, Duration>& abs_time, Predicate pred)
+    {
+        return condition_variable_any::wait_until(lock, abs_time, pred);
+    }
+};
+} //  Namespace mingw_stdthread
+
+namespace std
+{
+//    As in the other headers, only put these into std when MinGW's own win32
+//  thread model has left them out.
+#if defined(__MINGW32__ ) && !defined(_GLIBCXX_HAS_GTHREADS)
+using mingw_stdthread::cv_status;
+using mingw_stdthread::condition_variable;
+using mingw_stdthread::condition_variable_any;
+#endif
+} //  Namespace std
+#endif // MINGW_CONDITIONAL_VARIABLE_H
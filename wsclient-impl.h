@@ -1,13 +1,19 @@
 #pragma once
 
 #include "wscpp.h"
+#include <memory>
 
 #ifdef __MINGW32__
 #include "mingw.thread.h"
+#include "mingw.mutex.h"
 #else
 #include <thread>
+#include <mutex>
 #endif
 
+#include "wsuring.h"
+#include "wsdeflate.h"
+
 #ifdef _WIN32
 #define SECURITY_WIN32
 #include <sspi.h>
@@ -17,19 +23,32 @@ namespace ws {
 	class client_pimpl {
 	public:
 		client_pimpl(client& parent, const std::string& host, uint16_t port, const std::string& path,
-			     const client_msg_handler& msg_handler, const client_disconn_handler& disconn_handler);
+			     const client_msg_handler& msg_handler, const client_disconn_handler& disconn_handler,
+			     const client_options& options);
 		~client_pimpl();
 
 		void open_connexion();
 		void send_auth_response(const std::string_view& auth_type, const std::string_view& auth_msg, const std::string& req);
 		void send_handshake();
 		std::string random_key();
-		void send_raw(const std::string_view& s, unsigned int timeout = 0) const;
-		void set_send_timeout(unsigned int timeout) const;
+		void send_raw(const std::string_view& s, std::chrono::milliseconds timeout = {}) const;
+		void send_raw(const std::string_view* parts, size_t num_parts, std::chrono::milliseconds timeout = {}) const;
+		void send_frame(const std::string_view& payload, enum opcode opcode, bool compressed, std::chrono::milliseconds timeout,
+						bool fin = true);
+		void send_frame(const std::string_view* parts, size_t num_parts, enum opcode opcode, bool compressed,
+						std::chrono::milliseconds timeout, bool fin = true);
+		void send_fragment(const std::string_view& payload, enum opcode opcode, bool first, bool fin, bool& compressed);
+#ifdef _WIN32
+		void set_send_timeout(std::chrono::milliseconds timeout) const;
+#endif
 		std::string recv_http();
 		void recv_thread();
-		std::string recv(unsigned int len);
-		void parse_ws_message(enum opcode opcode, const std::string& payload);
+		size_t recv(char* buf, size_t len);
+		void parse_ws_message(enum opcode opcode, const std::string_view& payload);
+#ifdef HAVE_IO_URING
+		void uring_recv_loop();
+		void uring_send(const std::string_view* parts, size_t num_parts);
+#endif
 
 		client& parent;
 		std::string host;
@@ -37,6 +56,10 @@ namespace ws {
 		std::string path;
 		client_msg_handler msg_handler;
 		client_disconn_handler disconn_handler;
+		client_options options;
+		std::unique_ptr<std::pmr::synchronized_pool_resource> pool; // if options.memory_resource wasn't given
+		std::pmr::memory_resource* mr;
+		frame_parser parser;
 #ifdef _WIN32
 		SOCKET sock = INVALID_SOCKET;
 		CredHandle cred_handle = {(ULONG_PTR)-1, (ULONG_PTR)-1};
@@ -49,8 +72,17 @@ namespace ws {
 #endif
 		bool open = false;
 		std::thread* t = nullptr;
-		std::string payloadbuf;
 		std::string fqdn;
-		enum opcode last_opcode;
+#ifdef HAVE_IO_URING
+		std::unique_ptr<uring> recv_ring, send_ring;
+#endif
+		std::mutex send_mutex; // keeps each frame in one piece on the wire
+#ifdef HAVE_ZLIB
+		std::unique_ptr<deflater> compressor;
+#endif
+		// held while a text or binary frame is compressed and sent, and keeps other messages
+		// out of the middle of a message_writer's
+		std::mutex msg_mutex;
+		bool writing = false;
     };
 }
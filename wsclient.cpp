@@ -25,25 +25,41 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <poll.h>
 #include <gssapi/gssapi.h>
 #endif
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
 #include <random>
+#include <chrono>
+#include <vector>
+#include <algorithm>
 #include <map>
 #include <stdexcept>
 #include "wsclient-impl.h"
 #include "b64.h"
 #include "sha1.h"
 #include "gssexcept.h"
+#include "wsmask.h"
+#include "wswriter.h"
+#include "wsgather.h"
 
 using namespace std;
 
 #define MAGIC_STRING "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
 
+#ifdef HAVE_IO_URING
+static const unsigned int URING_ENTRIES = 64;
+static const unsigned int URING_BUFFERS = 64;
+static const unsigned int URING_BUFFER_SIZE = 16384;
+#endif
+
 namespace ws {
 	client::client(const string& host, uint16_t port, const string& path,
-		       const client_msg_handler& msg_handler, const client_disconn_handler& disconn_handler) {
-		impl = new client_pimpl(*this, host, port, path, msg_handler, disconn_handler);
+		       const client_msg_handler& msg_handler, const client_disconn_handler& disconn_handler,
+		       const client_options& options) {
+		impl = new client_pimpl(*this, host, port, path, msg_handler, disconn_handler, options);
 	}
 
 	void client_pimpl::open_connexion() {
@@ -112,13 +128,21 @@ namespace ws {
 	}
 
 	client_pimpl::client_pimpl(client& parent, const std::string& host, uint16_t port, const std::string& path,
-				   const client_msg_handler& msg_handler, const client_disconn_handler& disconn_handler) :
+				   const client_msg_handler& msg_handler, const client_disconn_handler& disconn_handler,
+				   const client_options& options) :
 			parent(parent),
 			host(host),
 			port(port),
 			path(path),
 			msg_handler(msg_handler),
-			disconn_handler(disconn_handler) {
+			disconn_handler(disconn_handler),
+			options(options),
+			pool(options.memory_resource ? nullptr : make_unique<pmr::synchronized_pool_resource>(pmr::pool_options{0, 65536})),
+			mr(options.memory_resource ? options.memory_resource : pool.get()),
+			parser([&](enum opcode opcode, const string_view& payload) { parse_ws_message(opcode, payload); }, nullptr, mr) {
+		parser.validate_utf8(options.validate_utf8);
+		parser.limit(options.limits);
+
 #ifdef _WIN32
 		WSADATA wsa_data;
 
@@ -130,11 +154,33 @@ namespace ws {
 			open_connexion();
 			send_handshake();
 
+			if (options.engine == client_engine::io_uring) {
+#ifdef HAVE_IO_URING
+				recv_ring = make_unique<uring>(URING_ENTRIES);
+				recv_ring->setup_buf_ring(0, URING_BUFFERS, URING_BUFFER_SIZE);
+				send_ring = make_unique<uring>(URING_ENTRIES);
+#else
+				throw runtime_error("io_uring engine is not supported on this platform.");
+#endif
+			}
+
 			t = new thread([&]() {
 				exception_ptr except;
 
 				try {
 					recv_thread();
+				} catch (const protocol_error& e) {
+					except = current_exception();
+
+					// best effort at telling the server why we're going
+					try {
+						string payload{(char)(e.status >> 8), (char)(e.status & 0xff)};
+
+						payload += string_view(e.what()).substr(0, 123);
+
+						parent.send(payload, opcode::close, chrono::seconds(1));
+					} catch (...) {
+					}
 				} catch (...) {
 					except = current_exception();
 				}
@@ -209,55 +255,118 @@ namespace ws {
 		return b64encode(string((char*)rand, 16));
 	}
 
-	void client_pimpl::set_send_timeout(unsigned int timeout) const {
 #ifdef _WIN32
-		DWORD tv = timeout * 1000;
+	void client_pimpl::set_send_timeout(chrono::milliseconds timeout) const {
+		DWORD tv = (DWORD)timeout.count();
 
 		if (setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv, sizeof(tv)) != 0) {
 			int err = WSAGetLastError();
 
 			throw runtime_error("setsockopt returned " + to_string(err) + ".");
 		}
-#else
-		struct timeval tv;
-		tv.tv_sec = timeout;
-		tv.tv_usec = 0;
-
-		if (setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv, sizeof(tv)) != 0) {
-			int err = errno;
-
-			throw runtime_error("setsockopt returned " + to_string(err) + ".");
-		}
+	}
 #endif
+
+	void client_pimpl::send_raw(const string_view& s, chrono::milliseconds timeout) const {
+		send_raw(&s, 1, timeout);
 	}
 
-	void client_pimpl::send_raw(const string_view& s, unsigned int timeout) const {
-		if (timeout != 0)
+#ifdef _WIN32
+	// Winsock has no MSG_DONTWAIT, and making the socket non-blocking would affect recv_thread too,
+	// so the timeout's set on the socket for the length of the call instead.
+	void client_pimpl::send_raw(const string_view* parts, size_t num_parts, chrono::milliseconds timeout) const {
+		if (timeout.count() != 0)
 			set_send_timeout(timeout);
 
 		try {
-			auto ret = ::send(sock, s.data(), (int)s.length(), 0);
+			// the socket's blocking, so each call only comes back short if it's timed out
+			for (size_t i = 0; i < num_parts; ) {
+				WSABUF bufs[64];
+				DWORD num = 0, ret;
+				size_t len = 0;
+
+				for (; i < num_parts && num < sizeof(bufs) / sizeof(bufs[0]); i++) {
+					bufs[num].buf = (char*)parts[i].data();
+					bufs[num].len = (ULONG)parts[i].length();
+					len += parts[i].length();
+					num++;
+				}
 
-#ifdef _WIN32
-			if (ret == SOCKET_ERROR)
-				throw runtime_error("send failed (error " + to_string(WSAGetLastError()) + ")");
-#else
-			if (ret == -1)
-				throw runtime_error("send failed (error " + to_string(errno) + ")");
-#endif
+				if (WSASend(sock, bufs, num, &ret, 0, nullptr, nullptr) == SOCKET_ERROR)
+					throw runtime_error("send failed (error " + to_string(WSAGetLastError()) + ")");
 
-			if ((size_t)ret < s.length())
-				throw runtime_error("send sent " + to_string(ret) + " bytes, expected " + to_string(s.length()));
+				if ((size_t)ret < len)
+					throw runtime_error("send sent " + to_string(ret) + " bytes, expected " + to_string(len));
+			}
 		} catch (...) {
-			if (timeout != 0)
-				set_send_timeout(0);
+			if (timeout.count() != 0)
+				set_send_timeout(chrono::milliseconds::zero());
 
 			throw;
 		}
 
-		if (timeout != 0)
-			set_send_timeout(0);
+		if (timeout.count() != 0)
+			set_send_timeout(chrono::milliseconds::zero());
 	}
+#else
+	// The socket stays blocking, as recv_thread needs it to be. With a timeout, each send is made
+	// with MSG_DONTWAIT instead, and if the socket's full we poll for it until the deadline.
+	void client_pimpl::send_raw(const string_view* parts, size_t num_parts, chrono::milliseconds timeout) const {
+		auto len = total_length(parts, num_parts);
+		auto deadline = chrono::steady_clock::now() + timeout;
+		size_t done = 0;
+		int flags = timeout.count() != 0 ? MSG_DONTWAIT : 0;
+
+#ifdef MSG_NOSIGNAL
+		flags |= MSG_NOSIGNAL;
+#endif
+
+		while (done < len) {
+			struct iovec iov[64];
+			struct msghdr msg;
+
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = gather(iov, sizeof(iov) / sizeof(iov[0]), parts, num_parts, done);
+
+			auto ret = sendmsg(sock, &msg, flags);
+
+			if (ret != -1) {
+				done += ret;
+				continue;
+			}
+
+			auto err = errno;
+
+			if (err == EINTR)
+				continue;
+
+			if (timeout.count() == 0 || (err != EAGAIN && err != EWOULDBLOCK))
+				throw runtime_error("send failed (error " + to_string(err) + ")");
+
+			auto left = chrono::ceil<chrono::milliseconds>(deadline - chrono::steady_clock::now());
+
+			if (left.count() <= 0) {
+				if (done == 0)
+					throw runtime_error("send timed out.");
+
+				// the peer would take whatever we sent next as the rest of this frame
+				shutdown(sock, SHUT_RDWR);
+
+				throw runtime_error("send timed out partway through a frame, so the connection has been closed.");
+			}
+
+			struct pollfd pfd;
+
+			pfd.fd = sock;
+			pfd.events = POLLOUT;
+			pfd.revents = 0;
+
+			if (poll(&pfd, 1, (int)min(left.count(), (chrono::milliseconds::rep)INT_MAX)) == -1 && errno != EINTR)
+				throw runtime_error("poll failed (error " + to_string(errno) + ")");
+		}
+	}
+#endif
 
 	string client_pimpl::recv_http() {
 		string buf;
@@ -305,6 +414,9 @@ namespace ws {
 
 				return buf.substr(0, buf.find("\r\n\r\n") + 4);
 			} else {
+				if (options.limits.max_header != 0 && buf.length() > options.limits.max_header)
+					throw runtime_error("HTTP response headers too long.");
+
 				int ret = ::recv(sock, s, bytes, MSG_WAITALL);
 
 #ifdef _WIN32
@@ -483,6 +595,11 @@ void client_pimpl::send_auth_response(const string_view& auth_type, const string
 					 "Sec-WebSocket-Key: "s + key + "\r\n"
 					 "Sec-WebSocket-Version: 13\r\n";
 
+#ifdef HAVE_ZLIB
+		if (options.deflate.enabled)
+			req += "Sec-WebSocket-Extensions: " + deflate_offer(options.deflate) + "\r\n";
+#endif
+
 		send_raw(req + "\r\n"s);
 
 		do {
@@ -563,15 +680,132 @@ void client_pimpl::send_auth_response(const string_view& auth_type, const string
 
 			if (headers.at("Sec-WebSocket-Accept") != b64encode(sha1(key + MAGIC_STRING)))
 				throw runtime_error("Invalid value for Sec-WebSocket-Accept.");
+
+			if (headers.count("Sec-WebSocket-Extensions") != 0) {
+#ifdef HAVE_ZLIB
+				if (!options.deflate.enabled)
+					throw runtime_error("Server accepted an extension we didn't offer.");
+
+				auto p = deflate_parse_response(headers.at("Sec-WebSocket-Extensions"), options.deflate);
+
+				compressor = make_unique<deflater>(p.client_max_window_bits, options.deflate.mem_level, p.client_no_context_takeover,
+												   mr);
+				parser.inflate(p.server_max_window_bits, p.server_no_context_takeover);
+#else
+				throw runtime_error("Server accepted an extension we didn't offer.");
+#endif
+			}
 		} while (again);
 	}
 
-	void client::send(const string_view& payload, enum opcode opcode, unsigned int timeout) const {
+	void client::send(const string_view& payload, enum opcode opcode, chrono::milliseconds timeout) const {
+		// control frames can go out in the middle of a message_writer's message
+		if ((uint8_t)opcode & 0x8) {
+			impl->send_frame(payload, opcode, false, timeout);
+			return;
+		}
+
+		lock_guard<mutex> guard(impl->msg_mutex);
+
+		if (impl->writing)
+			throw runtime_error("Can't send a message while a message_writer is partway through one.");
+
+#ifdef HAVE_ZLIB
+		if (impl->compressor && (opcode == opcode::text || opcode == opcode::binary) &&
+			payload.length() >= impl->options.deflate.min_size) {
+			impl->send_frame(impl->compressor->compress(payload), opcode, true, timeout);
+			return;
+		}
+#endif
+
+		impl->send_frame(payload, opcode, false, timeout);
+	}
+
+	// Our frames need a mask, so can't be the message's own. The header's gathered into the same
+	// send as the payload, which is only copied if it's being masked or compressed.
+	void client::send(const message& msg, chrono::milliseconds timeout) const {
+		if (msg.opcode() == opcode::invalid)
+			throw runtime_error("Can't send an empty message.");
+
+		send(msg.payload(), msg.opcode(), timeout);
+	}
+
+	void client::send(const string_view* parts, size_t num_parts, enum opcode opcode, chrono::milliseconds timeout) const {
+		auto len = total_length(parts, num_parts);
+		bool join = (uint8_t)opcode & 0x8;
+
+#ifdef HAVE_ZLIB
+		join = join || (impl->compressor && (opcode == opcode::text || opcode == opcode::binary) &&
+						len >= impl->options.deflate.min_size);
+#endif
+
+		// deflate needs it all in one place anyway
+		if (join) {
+			pmr::string payload(impl->mr);
+
+			payload.reserve(len);
+
+			for (size_t i = 0; i < num_parts; i++) {
+				payload.append(parts[i]);
+			}
+
+			send(payload, opcode, timeout);
+			return;
+		}
+
+		lock_guard<mutex> guard(impl->msg_mutex);
+
+		if (impl->writing)
+			throw runtime_error("Can't send a message while a message_writer is partway through one.");
+
+		impl->send_frame(parts, num_parts, opcode, false, timeout);
+	}
+
+	void client_pimpl::send_fragment(const string_view& payload, enum opcode opcode, bool first, bool fin, bool& compressed) {
+		lock_guard<mutex> guard(msg_mutex);
+
+		if (first) {
+			if (writing)
+				throw runtime_error("Can't send a message while a message_writer is partway through one.");
+
+#ifdef HAVE_ZLIB
+			compressed = compressor && (opcode == opcode::text || opcode == opcode::binary) &&
+						 payload.length() >= options.deflate.min_size;
+#endif
+		}
+
+		// only the first frame has the opcode and RSV1; the rest are continuations
+#ifdef HAVE_ZLIB
+		if (compressed)
+			send_frame(compressor->compress(payload, fin), first ? opcode : opcode::invalid, first, {}, fin);
+		else
+#endif
+			send_frame(payload, first ? opcode : opcode::invalid, false, {}, fin);
+
+		writing = !fin;
+	}
+
+	message_writer::message_writer(client& c, enum opcode opcode) {
+		impl = new message_writer_pimpl([&cp = *c.impl, opcode, compressed = false](const string_view& payload, bool first, bool fin) mutable {
+			cp.send_fragment(payload, opcode, first, fin, compressed);
+
+			return send_status::ok;
+		});
+	}
+
+	void client_pimpl::send_frame(const string_view& payload, enum opcode opcode, bool compressed, chrono::milliseconds timeout,
+								  bool fin) {
+		send_frame(&payload, 1, opcode, compressed, timeout, fin);
+	}
+
+	// the parts go out one after the other, as the frame's payload
+	void client_pimpl::send_frame(const string_view* parts, size_t num_parts, enum opcode opcode, bool compressed,
+								  chrono::milliseconds timeout, bool fin) {
 		string header;
-		uint64_t len = payload.length();
+		uint64_t len = total_length(parts, num_parts);
 
 		header.resize(6);
-		header[0] = 0x80 | ((uint8_t)opcode & 0xf);
+		header[0] = (fin ? 0x80 : 0) | (compressed ? 0x40 : 0) | ((uint8_t)opcode & 0xf);
 
 		if (len <= 125) {
 			header[1] = 0x80 | (uint8_t)len;
@@ -596,78 +830,80 @@ void client_pimpl::send_auth_response(const string_view& auth_type, const string
 			memset(&header[10], 0, 4);
 		}
 
-		impl->send_raw(header, timeout);
-		impl->send_raw(payload, timeout);
-	}
+		pmr::string masked(mr);
+		pmr::vector<string_view> v(mr);
 
-	string client_pimpl::recv(unsigned int len) {
-		string s;
-		int bytes, err = 0;
-		unsigned int left;
-		char* buf;
+		v.reserve(num_parts + 1);
+		v.emplace_back(header);
 
-		if (len == 0)
-			len = 4096;
+		if (options.random_mask) {
+			static thread_local mt19937 rng(random_device{}());
+			uint32_t key = (uint32_t)rng();
 
-		s.resize(len);
+			memcpy(&header[header.length() - sizeof(key)], &key, sizeof(key));
 
-		left = len;
-		buf = s.data();
+			masked.reserve(len);
 
-		do {
-			bytes = ::recv(sock, buf, left, 0);
+			for (size_t i = 0; i < num_parts; i++) {
+				masked.append(parts[i]);
+			}
 
-#ifdef _WIN32
-			if (bytes == SOCKET_ERROR) {
-				err = WSAGetLastError();
-#else
-			if (bytes == -1) {
-				err = errno;
-#endif
+			mask_payload(masked.data(), masked.data(), masked.length(), key);
+			v.emplace_back(masked);
+		} else
+			v.insert(v.end(), parts, parts + num_parts);
 
-#ifdef _WIN32
-				if (err == WSAEWOULDBLOCK)
-#else
-				if (err == EWOULDBLOCK)
+		// don't bother the kernel with empty parts
+		v.erase(remove_if(v.begin() + 1, v.end(), [](const string_view& sv) { return sv.empty(); }), v.end());
+
+#ifdef HAVE_IO_URING
+		if (send_ring && timeout.count() == 0) {
+			uring_send(v.data(), v.size());
+			return;
+		}
 #endif
-					continue;
-				else
-					break;
-			}
 
-			if (bytes == 0) {
-				open = false;
-				return "";
-			}
+		// a pong mustn't get between the header and the payload
+		lock_guard<mutex> guard(send_mutex);
+
+		send_raw(v.data(), v.size(), timeout);
+	}
 
-			buf += bytes;
-			left -= bytes;
-		} while (left > 0);
+	size_t client_pimpl::recv(char* buf, size_t len) {
+		int bytes, err = 0;
+
+		do {
+			bytes = ::recv(sock, buf, (int)len, 0);
 
 #ifdef _WIN32
-		if (bytes == SOCKET_ERROR) {
-			if (err == WSAECONNRESET) {
-				open = false;
-				return "";
-			}
+			if (bytes == SOCKET_ERROR)
+				err = WSAGetLastError();
+		} while (bytes == SOCKET_ERROR && err == WSAEWOULDBLOCK);
 
+		if (bytes == 0 || (bytes == SOCKET_ERROR && err == WSAECONNRESET)) {
+			open = false;
+			return 0;
+		} else if (bytes == SOCKET_ERROR)
 			throw runtime_error("recv failed (" + to_string(err) + ").");
-		}
 #else
-		if (bytes == -1) {
-			if (err == ECONNRESET) {
-				open = false;
-				return "";
-			}
+			if (bytes == -1)
+				err = errno;
+		} while (bytes == -1 && err == EWOULDBLOCK);
 
+		if (bytes == 0 || (bytes == -1 && err == ECONNRESET)) {
+			open = false;
+			return 0;
+		} else if (bytes == -1)
 			throw runtime_error("recv failed (" + to_string(err) + ").");
-		}
 #endif
 
-		return s;
+		return bytes;
 	}
 
-	void client_pimpl::parse_ws_message(enum opcode opcode, const string& payload) {
+	void client_pimpl::parse_ws_message(enum opcode opcode, const string_view& payload) {
+		if (!open)
+			return;
+
 		switch (opcode) {
 			case opcode::close:
 				open = false;
@@ -681,83 +917,118 @@ void client_pimpl::send_auth_response(const string_view& auth_type, const string
 				break;
 		}
 
-		if (msg_handler)
+		if (options.message_handler)
+			options.message_handler(parent, message(payload, opcode)); // can outlive the client, so not from its pool
+		else if (msg_handler)
 			msg_handler(parent, payload, opcode);
 	}
 
 	void client_pimpl::recv_thread() {
+#ifdef HAVE_IO_URING
+		if (recv_ring) {
+			uring_recv_loop();
+			return;
+		}
+#endif
+
+		// read straight into the parser's buffer, so complete messages are never copied
 		while (open) {
-			string header = recv(2);
+			size_t len;
+			auto buf = parser.prepare(len);
+			auto bytes = recv(buf, len);
 
-			if (!open)
-				break;
+			if (bytes != 0)
+				parser.commit(bytes);
+		}
+	}
 
-			bool fin = (header[0] & 0x80) != 0;
-			auto opcode = (enum opcode)(uint8_t)(header[0] & 0xf);
-			bool mask = (header[1] & 0x80) != 0;
-			uint64_t len = header[1] & 0x7f;
+#ifdef HAVE_IO_URING
+	void client_pimpl::uring_recv_loop() {
+		recv_ring->prep_recv_multishot(sock, 0);
 
-			if (len == 126) {
-				string extlen = recv(2);
+		while (open) {
+			recv_ring->submit(1);
 
-				if (!open)
-					break;
+			while (auto cqe = recv_ring->peek_cqe()) {
+				int res = cqe->res;
+				uint32_t flags = cqe->flags;
 
-				len = ((uint8_t)extlen[0] << 8) | (uint8_t)extlen[1];
-			} else if (len == 127) {
-				string extlen = recv(8);
+				recv_ring->cqe_seen();
+
+				if (res > 0) {
+					auto bid = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+
+					try {
+						parser.feed(recv_ring->buf(bid), res);
+					} catch (...) {
+						recv_ring->recycle_buf(bid);
+						throw;
+					}
+
+					recv_ring->recycle_buf(bid);
+				} else if (res == 0 || res == -ECONNRESET) {
+					open = false;
+					return;
+				} else if (res != -ENOBUFS)
+					throw runtime_error("recv failed (" + to_string(-res) + ").");
 
 				if (!open)
-					break;
-
-				len = (uint8_t)extlen[0];
-				len <<= 8;
-				len |= (uint8_t)extlen[1];
-				len <<= 8;
-				len |= (uint8_t)extlen[2];
-				len <<= 8;
-				len |= (uint8_t)extlen[3];
-				len <<= 8;
-				len |= (uint8_t)extlen[4];
-				len <<= 8;
-				len |= (uint8_t)extlen[5];
-				len <<= 8;
-				len |= (uint8_t)extlen[6];
-				len <<= 8;
-				len |= (uint8_t)extlen[7];
+					return;
+
+				if (!(flags & IORING_CQE_F_MORE))
+					recv_ring->prep_recv_multishot(sock, 0);
 			}
+		}
+	}
 
-			string mask_key;
-			if (mask) {
-				mask_key = recv(4);
+	// the parts go in one sendmsg, and another for whatever's left after a short write
+	void client_pimpl::uring_send(const string_view* parts, size_t num_parts) {
+		lock_guard<mutex> guard(send_mutex);
+		size_t i = 0, off = 0;
 
-				if (!open)
-					break;
+		while (i < num_parts) {
+			struct iovec iov[64];
+			struct msghdr msg;
+
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+
+			for (size_t j = i; j < num_parts && msg.msg_iovlen < sizeof(iov) / sizeof(iov[0]); j++) {
+				auto sv = j == i ? parts[j].substr(off) : parts[j];
+
+				iov[msg.msg_iovlen].iov_base = (void*)sv.data();
+				iov[msg.msg_iovlen].iov_len = sv.length();
+				msg.msg_iovlen++;
 			}
 
-			string payload = len == 0 ? "" : recv((unsigned int)len);
+			send_ring->prep_sendmsg(sock, &msg, 0);
+			send_ring->submit(1);
 
-			if (!open)
-				break;
+			struct io_uring_cqe* cqe;
 
-			if (mask) {
-				for (unsigned int i = 0; i < payload.length(); i++) {
-					payload[i] ^= mask_key[i % 4];
-				}
+			while (!(cqe = send_ring->peek_cqe())) {
+				send_ring->submit(1);
 			}
 
-			if (!fin) {
-				if (opcode != opcode::invalid)
-					last_opcode = opcode;
+			int res = cqe->res;
+
+			send_ring->cqe_seen();
 
-				payloadbuf += payload;
-			} else if (payloadbuf != "") {
-				parse_ws_message(last_opcode, payloadbuf + payload);
-				payloadbuf = "";
-			} else
-				parse_ws_message(opcode, payload);
+			if (res < 0)
+				throw runtime_error("send failed (error " + to_string(-res) + ")");
+
+			size_t bytes = res;
+
+			while (i < num_parts && bytes >= parts[i].length() - off) {
+				bytes -= parts[i].length() - off;
+				i++;
+				off = 0;
+			}
+
+			off += bytes;
 		}
 	}
+#endif
 
 	void client::join() const {
 		if (impl->t)
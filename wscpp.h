@@ -18,7 +18,12 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <functional>
+#include <exception>
+#include <chrono>
+#include <memory>
+#include <memory_resource>
 #include <stdint.h>
 
 #ifdef _WIN32
@@ -60,15 +65,155 @@ namespace ws {
 		pong = 10
 	};
 
+	class protocol_error : public std::exception {
+	public:
+		protocol_error(uint16_t status, const std::string& msg) : status(status), msg(msg) { }
+
+		virtual const char* what() const noexcept {
+			return msg.c_str();
+		}
+
+		uint16_t status; // close code to send to the peer
+
+	private:
+		std::string msg;
+	};
+
+	// continuation frames are reported with opcode::invalid
+	typedef std::function<void(enum opcode opcode, bool fin, const std::string_view&)> parser_frame_handler;
+	typedef std::function<void(enum opcode opcode, const std::string_view&)> parser_msg_handler;
+
+	// opcode is the message's own on the first call for each message, and opcode::invalid after that
+	typedef std::function<void(enum opcode opcode, const std::string_view&, bool fin)> parser_stream_handler;
+
+	// permessage-deflate (RFC 7692), if wscpp was built with zlib. Window bits and mem_level
+	// bound zlib's memory per connection: about (1 << (window_bits + 2)) + (1 << (mem_level + 9))
+	// bytes to compress, and (1 << window_bits) + 7 KB to decompress.
+	struct deflate_options {
+		bool enabled = false;
+		bool server_no_context_takeover = false;
+		bool client_no_context_takeover = false;
+		unsigned int server_max_window_bits = 15; // 9 to 15
+		unsigned int client_max_window_bits = 15;
+		unsigned int mem_level = 8; // 1 to 9
+		size_t min_size = 64; // anything shorter goes out uncompressed
+	};
+
+	// Caps on what a peer can make us allocate, checked before the memory's taken. Going over one
+	// closes the connection with status 1009. Zero means no limit.
+	struct size_limits {
+		uint64_t max_frame = 0; // payload length in a frame header
+		uint64_t max_message = 0; // whole message, after decompression
+		size_t max_header = 65536; // the HTTP handshake
+		size_t max_buffer = 0; // incomplete frames and messages held for a connection at once
+	};
+
+	class frame_parser_pimpl;
+
+	// Incremental websocket frame parser, which does no I/O of its own. Feed it bytes as they
+	// arrive, in chunks of any size, and it calls frame_handler for each complete frame and
+	// msg_handler for each complete message, reassembling fragmented ones.
+	// Payloads of unfragmented messages point into the parser's own buffer (or the caller's,
+	// for the non-const feed), so they're only valid until the handler returns.
+	// Its buffers come from mr, or the default resource if that's null.
+	class WSCPP frame_parser {
+	public:
+		frame_parser(const parser_msg_handler& msg_handler, const parser_frame_handler& frame_handler = nullptr,
+					 std::pmr::memory_resource* mr = nullptr);
+		~frame_parser();
+
+		void feed(const std::string_view& data);
+		void feed(char* data, size_t len); // unmasks in place, so data gets overwritten
+
+		// Zero-copy alternative to feed: recv into the space prepare returns, then tell
+		// commit how many bytes arrived.
+		char* prepare(size_t& len);
+		void commit(size_t len);
+
+		// Decompress messages with RSV1 set, once permessage-deflate has been negotiated.
+		// frame_handler still sees the frames as they were on the wire.
+		void inflate(unsigned int window_bits, bool no_context_takeover);
+
+		// Check that text messages are valid UTF-8, as RFC 6455 says they must be, and throw a
+		// protocol_error with status 1007 if not. Fragments are checked as they arrive.
+		void validate_utf8(bool enabled);
+
+		// Hand over text and binary messages a piece at a time as they arrive, even partway through
+		// a frame, rather than buffering them whole, so memory use doesn't grow with message size.
+		// Control frames still go to msg_handler, but frame_handler no longer sees data frames.
+		void stream(const parser_stream_handler& handler);
+
+		// max_header isn't used here, as the parser never sees the handshake.
+		void limit(const size_limits& limits);
+
+		size_t buffered() const; // bytes of incomplete frames and messages being held
+
+	private:
+		frame_parser_pimpl* impl;
+	};
+
 	class client;
 	class client_thread;
+	class message_writer;
+	class server;
+
+	// A message that owns its payload, for keeping past the end of a handler, passing to another
+	// thread, or sending on to any number of connections. Copies share the one buffer, which is
+	// never changed once made. It's laid out as an unmasked frame, so a server can send it as it is.
+	// The buffer comes from mr, or the default resource if that's null, and mr has to outlive every copy.
+	class WSCPP message {
+	public:
+		message() = default; // empty, with opcode::invalid; sending one throws
+		explicit message(const std::string_view& payload, enum opcode opcode = ws::opcode::text,
+						 std::pmr::memory_resource* mr = nullptr);
+
+		std::string_view payload() const;
+		enum opcode opcode() const;
+
+		friend client_thread;
+		friend server;
+
+	private:
+		std::shared_ptr<const std::pmr::string> frame;
+	};
 
 	typedef std::function<void(client&, const std::string_view&, enum opcode opcode)> client_msg_handler;
+	typedef std::function<void(client&, message msg)> client_message_handler;
 	typedef std::function<void(client&, const std::exception_ptr&)> client_disconn_handler;
 
 	typedef std::function<void(client_thread&, const std::string_view&)> server_msg_handler;
+	typedef std::function<void(client_thread&, const std::string_view&, enum opcode opcode)> server_opcode_msg_handler;
+	typedef std::function<void(client_thread&, message msg)> server_message_handler;
 	typedef std::function<void(client_thread&)> server_conn_handler;
 	typedef std::function<void(client_thread&, const std::exception_ptr&)> server_disconn_handler;
+	typedef std::function<void(client_thread&, bool slow)> server_backpressure_handler;
+
+	// Receives text and binary messages piecemeal instead of msg_handler: begin with the opcode,
+	// chunk as the payload arrives, then end. Compressed messages are inflated on the way.
+	struct server_stream_handler {
+		std::function<void(client_thread&, enum opcode opcode)> begin;
+		std::function<void(client_thread&, const std::string_view&)> chunk;
+		std::function<void(client_thread&)> end;
+	};
+	typedef std::function<bool(client_thread&)> server_filter;
+
+	// what a server's connections are holding, summed across all of them
+	struct buffer_usage {
+		size_t inbound = 0; // incomplete frames and messages, and unparsed handshakes
+		size_t outbound = 0; // queued to send
+		size_t paused = 0; // connections not being read from because of memory_budget
+	};
+
+	struct fanout_stats {
+		size_t recipients = 0; // connections it was queued on
+		unsigned int threads = 0; // I/O threads it was split between, or 0 if it was all done by the caller
+		std::chrono::nanoseconds spread{}; // from queueing it on the first connection to the last
+	};
+
+	enum class send_status {
+		ok,
+		backpressure // queued, but the peer isn't keeping up: more than send_high_water bytes are waiting
+	};
 
 	class sockets_error : public std::exception {
 	public:
@@ -83,17 +228,26 @@ namespace ws {
 		std::string msg;
 	};
 
-	class server;
 	class client_thread_pimpl;
+	class server_pimpl;
+	class reactor;
+	class registry;
 
 	class WSCPP client_thread {
 	public:
 		client_thread(void* sock, server& serv, const server_msg_handler& msg_handler,
 			      const server_conn_handler& conn_handler, const server_disconn_handler& disconn_handler);
 		~client_thread();
-		void send(const std::string_view& payload, enum opcode opcode = opcode::text) const;
+		send_status send(const std::string_view& payload, enum opcode opcode = opcode::text) const;
+		send_status send(const message& msg) const;
+		// Conflated: drops a message with the same key that's queued but hasn't started going out, so a
+		// slow peer gets the latest rather than a backlog. This one goes at the back of the queue, so
+		// it's never sent ahead of anything sent before it. Only the epoll and io_uring engines queue.
+		send_status send(const message& msg, const std::string_view& key) const;
+		send_status send(const std::string_view* parts, size_t num_parts, enum opcode opcode = opcode::text) const; // as one frame
 		std::string_view username() const;
 		std::string_view domain_name() const;
+		uint64_t id() const; // unique for the life of the server, for use with server::find
 #ifdef _WIN32
 		void impersonate() const;
 		void revert() const;
@@ -104,46 +258,153 @@ namespace ws {
 
 		friend client_thread_pimpl;
 		friend server;
+		friend server_pimpl;
+		friend reactor;
+		friend registry;
+		friend message_writer;
 
 	private:
 		client_thread_pimpl* impl;
 	};
 
-	class server_pimpl;
+	enum class server_engine {
+		threads,
+		epoll,
+		io_uring
+	};
+
+	struct server_options {
+		server_engine engine = server_engine::threads;
+		unsigned int io_threads = 0; // 0 means one per core, up to 255, which is the most allowed
+		bool sharded = false; // each I/O thread gets its own SO_REUSEPORT listener
+		unsigned int handler_threads = 0; // 0 means handlers run on the I/O threads
+		size_t send_high_water = 1048576;
+
+		// Called with true when a connection's outbound queue goes over send_high_water, and
+		// with false once it's drained to half that. It can be called from any thread.
+		server_backpressure_handler backpressure_handler;
+
+		// If set, called for both text and binary messages in place of msg_handler, which only sees text.
+		server_opcode_msg_handler opcode_msg_handler;
+
+		// Like opcode_msg_handler, and used in its place if set, but the message is the handler's to keep.
+		server_message_handler message_handler;
+
+		// If any of these are set, big uploads can be handled without holding them in memory.
+		server_stream_handler stream;
+
+		bool validate_utf8 = false; // close with 1007 if a text message isn't valid UTF-8
+		deflate_options deflate;
+		size_limits limits;
+
+		// Once inbound and outbound buffers across all connections add up to more than this, the
+		// epoll and io_uring engines stop reading from whichever are using more than their share,
+		// until it's down to three-quarters. 0 means no budget.
+		size_t memory_budget = 0;
+
+		// Where frame and payload buffers are allocated from. It's used from several threads at
+		// once, so has to be thread-safe, and has to outlive the server. If null, each server has
+		// its own pools, in size classes, with anything over 64 KB going straight to new.
+		std::pmr::memory_resource* memory_resource = nullptr;
+
+		// A broadcast or publish to at least this many connections is split between the epoll or
+		// io_uring engine's I/O threads, each queueing it on its own connections, and the caller
+		// waits for them all. A broadcast's filter is then called on those threads. 0 means never.
+		size_t fanout_threshold = 4096;
+	};
 
 	class WSCPP server {
 	public:
 		server(uint16_t port, int backlog, const server_msg_handler& msg_handler = nullptr,
 			   const server_conn_handler& conn_handler = nullptr,
 			   const server_disconn_handler& disconn_handler = nullptr,
-			   const std::string_view& auth_type = "");
+			   const std::string_view& auth_type = "",
+			   const server_options& options = {});
 		~server();
 
 		void start();
 		void for_each(std::function<void(client_thread&)> func);
+		bool find(uint64_t id, const std::function<void(client_thread&)>& func); // false if it's gone
+		fanout_stats broadcast(const std::string_view& payload, enum opcode opcode = opcode::text, const server_filter& filter = nullptr);
+		fanout_stats broadcast(const message& msg, const server_filter& filter = nullptr);
+		void subscribe(client_thread& ct, const std::string_view& topic);
+		void unsubscribe(client_thread& ct, const std::string_view& topic);
+		fanout_stats publish(const std::string_view& topic, const std::string_view& payload, enum opcode opcode = opcode::text);
+		fanout_stats publish(const std::string_view& topic, const message& msg);
+		fanout_stats publish(const std::string_view& topic, const message& msg, const std::string_view& key); // conflated, as for client_thread::send
 		void close();
+		buffer_usage buffered() const;
 
 		friend client_thread;
 		friend client_thread_pimpl;
+		friend registry;
 
 	private:
 		server_pimpl* impl;
 	};
 
+	enum class client_engine {
+		blocking,
+		io_uring
+	};
+
+	struct client_options {
+		client_engine engine = client_engine::blocking;
+		bool random_mask = false; // mask with a random key, as RFC 6455 asks, rather than all zeroes
+		bool validate_utf8 = false; // close with 1007 if a text message isn't valid UTF-8
+		deflate_options deflate;
+		size_limits limits;
+		std::pmr::memory_resource* memory_resource = nullptr; // as for server_options
+		client_message_handler message_handler; // used in place of msg_handler if set, with a message to keep
+	};
+
 	class client_pimpl;
 
 	class WSCPP client {
 	public:
 		client(const std::string& host, uint16_t port, const std::string& path, const client_msg_handler& msg_handler = nullptr,
-			const client_disconn_handler& disconn_handler = nullptr);
+			const client_disconn_handler& disconn_handler = nullptr, const client_options& options = {});
 		~client();
-		void send(const std::string_view& payload, enum opcode opcode = opcode::text, unsigned int timeout = 0) const;
+		// A timeout of zero means wait as long as it takes. If it runs out before any of the frame's
+		// gone, send throws and the connection can still be used; if it was partway through, the
+		// connection's closed as well.
+		void send(const std::string_view& payload, enum opcode opcode = opcode::text,
+				  std::chrono::milliseconds timeout = {}) const;
+		void send(const message& msg, std::chrono::milliseconds timeout = {}) const;
+
+		// Sends the parts one after the other as a single frame, in one syscall where it can,
+		// so an envelope and a body don't have to be concatenated first.
+		void send(const std::string_view* parts, size_t num_parts, enum opcode opcode = opcode::text,
+				  std::chrono::milliseconds timeout = {}) const;
 		void join() const;
 		bool is_open() const;
 
+		friend message_writer;
+
 	private:
 		client_pimpl* impl;
 	};
+
+	class message_writer_pimpl;
+
+	// Sends a message a fragment at a time, as the application produces it, so it never has to
+	// be in memory all at once. Control frames can still go out between fragments, but sending
+	// another message on the connection before this one's finished throws.
+	// With permessage-deflate, the first fragment decides whether the message is compressed.
+	class WSCPP message_writer {
+	public:
+		message_writer(client_thread& ct, enum opcode opcode = opcode::text);
+		message_writer(client& c, enum opcode opcode = opcode::text);
+		~message_writer(); // finishes the message, if it's been started
+		message_writer(const message_writer&) = delete;
+		message_writer& operator=(const message_writer&) = delete;
+
+		send_status write(const std::string_view& data);
+		send_status finish(const std::string_view& data = {});
+
+	private:
+		message_writer_pimpl* impl;
+	};
 }
 
 #ifdef _MSC_VER
@@ -0,0 +1,340 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of wscpp.
+ *
+ * wscpp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * wscpp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with wscpp.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifdef HAVE_ZLIB
+
+#include <string.h>
+#include <vector>
+#include <stdexcept>
+#include "wsdeflate.h"
+
+using namespace std;
+
+static const char DEFLATE_TAIL[] = { 0, 0, (char)0xff, (char)0xff };
+
+namespace ws {
+	struct ext_param {
+		string name, value;
+		bool has_value = false;
+	};
+
+	static string_view trim(string_view s) {
+		while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+			s.remove_prefix(1);
+		}
+
+		while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+			s.remove_suffix(1);
+		}
+
+		return s;
+	}
+
+	// splits "a; b=1, c" into extensions, each a list of parameters with the name first
+	static vector<vector<ext_param>> parse_extensions(const string& header) {
+		vector<vector<ext_param>> exts;
+		string_view sv = header;
+
+		while (!sv.empty()) {
+			auto comma = sv.find(',');
+			auto ext = sv.substr(0, comma);
+			vector<ext_param> params;
+
+			sv = comma == string::npos ? string_view() : sv.substr(comma + 1);
+
+			while (!ext.empty()) {
+				auto semi = ext.find(';');
+				auto p = trim(ext.substr(0, semi));
+				ext_param param;
+
+				ext = semi == string::npos ? string_view() : ext.substr(semi + 1);
+
+				auto eq = p.find('=');
+
+				if (eq == string::npos)
+					param.name = p;
+				else {
+					auto value = trim(p.substr(eq + 1));
+
+					if (value.length() >= 2 && value.front() == '"' && value.back() == '"')
+						value = value.substr(1, value.length() - 2);
+
+					param.name = trim(p.substr(0, eq));
+					param.value = value;
+					param.has_value = true;
+				}
+
+				params.push_back(param);
+			}
+
+			if (!params.empty() && !params[0].name.empty())
+				exts.push_back(params);
+		}
+
+		return exts;
+	}
+
+	static bool parse_window_bits(const ext_param& param, unsigned int& bits) {
+		if (param.value.empty() || param.value.length() > 2 || param.value.find_first_not_of("0123456789") != string::npos)
+			return false;
+
+		bits = stoul(param.value);
+
+		// 8 is legal, but zlib quietly turns it into 9 when compressing
+		return bits >= 9 && bits <= 15;
+	}
+
+	static unsigned int clamp_bits(unsigned int bits) {
+		return bits < 9 ? 9 : (bits > 15 ? 15 : bits);
+	}
+
+	string deflate_offer(const deflate_options& opts) {
+		string s = "permessage-deflate";
+
+		if (opts.server_no_context_takeover)
+			s += "; server_no_context_takeover";
+
+		if (opts.client_no_context_takeover)
+			s += "; client_no_context_takeover";
+
+		if (clamp_bits(opts.server_max_window_bits) < 15)
+			s += "; server_max_window_bits=" + to_string(clamp_bits(opts.server_max_window_bits));
+
+		if (clamp_bits(opts.client_max_window_bits) < 15)
+			s += "; client_max_window_bits=" + to_string(clamp_bits(opts.client_max_window_bits));
+		else
+			s += "; client_max_window_bits";
+
+		return s;
+	}
+
+	bool deflate_accept(const string& header, const deflate_options& opts, deflate_params& params, string& response) {
+		for (const auto& ext : parse_extensions(header)) {
+			deflate_params p;
+			bool valid = true, client_bits_offered = false;
+			unsigned int client_limit = 15;
+
+			if (ext[0].name != "permessage-deflate" || ext[0].has_value)
+				continue;
+
+			p.server_no_context_takeover = opts.server_no_context_takeover;
+			p.client_no_context_takeover = opts.client_no_context_takeover;
+			p.server_max_window_bits = clamp_bits(opts.server_max_window_bits);
+
+			for (size_t i = 1; i < ext.size() && valid; i++) {
+				const auto& param = ext[i];
+
+				if (param.name == "server_no_context_takeover" && !param.has_value)
+					p.server_no_context_takeover = true;
+				else if (param.name == "client_no_context_takeover" && !param.has_value)
+					p.client_no_context_takeover = true;
+				else if (param.name == "server_max_window_bits") {
+					unsigned int bits;
+
+					valid = parse_window_bits(param, bits);
+
+					if (valid && bits < p.server_max_window_bits)
+						p.server_max_window_bits = bits;
+				} else if (param.name == "client_max_window_bits") {
+					client_bits_offered = true;
+
+					if (param.has_value)
+						valid = parse_window_bits(param, client_limit);
+				} else
+					valid = false;
+			}
+
+			if (!valid)
+				continue;
+
+			// we can only ask the client to shrink its window if it said it could
+			if (client_bits_offered)
+				p.client_max_window_bits = min(clamp_bits(opts.client_max_window_bits), client_limit);
+
+			response = "permessage-deflate";
+
+			if (p.server_no_context_takeover)
+				response += "; server_no_context_takeover";
+
+			if (p.client_no_context_takeover)
+				response += "; client_no_context_takeover";
+
+			if (p.server_max_window_bits < 15)
+				response += "; server_max_window_bits=" + to_string(p.server_max_window_bits);
+
+			if (p.client_max_window_bits < 15)
+				response += "; client_max_window_bits=" + to_string(p.client_max_window_bits);
+
+			params = p;
+
+			return true;
+		}
+
+		return false;
+	}
+
+	deflate_params deflate_parse_response(const string& header, const deflate_options& opts) {
+		auto exts = parse_extensions(header);
+		deflate_params p;
+
+		if (exts.size() != 1 || exts[0][0].name != "permessage-deflate" || exts[0][0].has_value)
+			throw runtime_error("Server accepted an extension we didn't offer.");
+
+		const auto& ext = exts[0];
+
+		p.client_max_window_bits = clamp_bits(opts.client_max_window_bits);
+
+		for (size_t i = 1; i < ext.size(); i++) {
+			const auto& param = ext[i];
+			unsigned int bits;
+
+			if (param.name == "server_no_context_takeover" && !param.has_value)
+				p.server_no_context_takeover = true;
+			else if (param.name == "client_no_context_takeover" && !param.has_value)
+				p.client_no_context_takeover = true;
+			else if (param.name == "server_max_window_bits" && parse_window_bits(param, bits) &&
+					 bits <= clamp_bits(opts.server_max_window_bits))
+				p.server_max_window_bits = bits;
+			else if (param.name == "client_max_window_bits" && parse_window_bits(param, bits))
+				p.client_max_window_bits = min(p.client_max_window_bits, bits);
+			else
+				throw runtime_error("Invalid permessage-deflate parameter " + param.name + " in response.");
+		}
+
+		if (opts.server_no_context_takeover && !p.server_no_context_takeover)
+			throw runtime_error("Server ignored server_no_context_takeover.");
+
+		if (clamp_bits(opts.server_max_window_bits) < p.server_max_window_bits)
+			throw runtime_error("Server ignored server_max_window_bits.");
+
+		// following our own request costs nothing, and saves memory on the server
+		if (opts.client_no_context_takeover)
+			p.client_no_context_takeover = true;
+
+		return p;
+	}
+
+	deflater::deflater(unsigned int window_bits, unsigned int mem_level, bool no_context_takeover, pmr::memory_resource* mr) :
+		no_context_takeover(no_context_takeover),
+		out(mr ? mr : pmr::get_default_resource()) {
+		memset(&strm, 0, sizeof(strm));
+
+		// negative window bits means raw deflate, without the zlib header and checksum
+		auto ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -(int)clamp_bits(window_bits),
+								mem_level < 1 ? 1 : (mem_level > 9 ? 9 : mem_level), Z_DEFAULT_STRATEGY);
+
+		if (ret != Z_OK)
+			throw runtime_error("deflateInit2 failed (" + to_string(ret) + ").");
+	}
+
+	deflater::~deflater() {
+		deflateEnd(&strm);
+	}
+
+	string_view deflater::compress(const string_view& in, bool fin) {
+		size_t len = 0;
+
+		out.resize(deflateBound(&strm, in.length()) + 16);
+
+		strm.next_in = (Bytef*)in.data();
+		strm.avail_in = (uInt)in.length();
+
+		do {
+			if (out.length() - len < 64)
+				out.resize(out.length() * 2);
+
+			strm.next_out = (Bytef*)out.data() + len;
+			strm.avail_out = (uInt)(out.length() - len);
+
+			auto ret = deflate(&strm, Z_SYNC_FLUSH);
+
+			if (ret != Z_OK && ret != Z_BUF_ERROR)
+				throw runtime_error("deflate failed (" + to_string(ret) + ").");
+
+			len = out.length() - strm.avail_out;
+		} while (strm.avail_in > 0 || strm.avail_out == 0);
+
+		// the tail has to stay on earlier fragments, or the next one would run on from a half-finished block
+		if (!fin)
+			return string_view(out.data(), len);
+
+		if (no_context_takeover)
+			deflateReset(&strm);
+
+		// a sync flush always ends with an empty stored block
+		if (len >= sizeof(DEFLATE_TAIL) && !memcmp(out.data() + len - sizeof(DEFLATE_TAIL), DEFLATE_TAIL, sizeof(DEFLATE_TAIL)))
+			len -= sizeof(DEFLATE_TAIL);
+
+		return string_view(out.data(), len);
+	}
+
+	inflater::inflater(unsigned int window_bits, bool no_context_takeover) :
+		no_context_takeover(no_context_takeover) {
+		memset(&strm, 0, sizeof(strm));
+
+		auto ret = inflateInit2(&strm, -(int)clamp_bits(window_bits));
+
+		if (ret != Z_OK)
+			throw runtime_error("inflateInit2 failed (" + to_string(ret) + ").");
+	}
+
+	inflater::~inflater() {
+		inflateEnd(&strm);
+	}
+
+	void inflater::run(const char* in, size_t len, const function<void(const string_view&)>& out) {
+		char buf[16384];
+
+		strm.next_in = (Bytef*)in;
+		strm.avail_in = (uInt)len;
+
+		do {
+			strm.next_out = (Bytef*)buf;
+			strm.avail_out = sizeof(buf);
+
+			auto ret = inflate(&strm, Z_SYNC_FLUSH);
+			bool full = strm.avail_out == 0;
+
+			if (strm.avail_out < sizeof(buf))
+				out(string_view(buf, sizeof(buf) - strm.avail_out));
+
+			if (ret == Z_STREAM_END) // the peer finished the stream with a final block
+				inflateReset(&strm);
+			else if (ret == Z_BUF_ERROR && strm.avail_in == 0) // no progress possible until more input
+				break;
+			else if (ret != Z_OK)
+				throw protocol_error(1007, "Invalid compressed data.");
+
+			// a full buffer can mean there's more output to come, even with no input left
+			if (!full && strm.avail_in == 0)
+				break;
+		} while (true);
+	}
+
+	void inflater::decompress(const string_view& in, bool fin, const function<void(const string_view&)>& out) {
+		run(in.data(), in.length(), out);
+
+		if (fin) {
+			run(DEFLATE_TAIL, sizeof(DEFLATE_TAIL), out);
+
+			if (no_context_takeover)
+				inflateReset(&strm);
+		}
+	}
+}
+
+#endif
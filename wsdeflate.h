@@ -0,0 +1,58 @@
+#pragma once
+
+#include "wscpp.h"
+#include <string>
+#include <functional>
+
+#ifdef HAVE_ZLIB
+
+#include <zlib.h>
+
+namespace ws {
+	// what was agreed in Sec-WebSocket-Extensions, from the point of view of the wire
+	struct deflate_params {
+		bool server_no_context_takeover = false;
+		bool client_no_context_takeover = false;
+		unsigned int server_max_window_bits = 15;
+		unsigned int client_max_window_bits = 15;
+	};
+
+	std::string deflate_offer(const deflate_options& opts);
+	bool deflate_accept(const std::string& header, const deflate_options& opts, deflate_params& params, std::string& response);
+	deflate_params deflate_parse_response(const std::string& header, const deflate_options& opts);
+
+	// One direction of permessage-deflate. Messages are compressed with a sync flush, and the
+	// trailing 00 00 ff ff that leaves is dropped, as RFC 7692 says.
+	class deflater {
+	public:
+		deflater(unsigned int window_bits, unsigned int mem_level, bool no_context_takeover,
+				 std::pmr::memory_resource* mr = nullptr);
+		~deflater();
+
+		// only valid until the next call; fin is clear for all but the last fragment of a message
+		std::string_view compress(const std::string_view& in, bool fin = true);
+
+	private:
+		z_stream strm;
+		bool no_context_takeover;
+		std::pmr::string out;
+	};
+
+	class inflater {
+	public:
+		inflater(unsigned int window_bits, bool no_context_takeover);
+		~inflater();
+
+		// Hands the output over a bufferful at a time, so a small frame that inflates to something
+		// huge never has to be held in memory all at once. fin is set on the last frame of the message.
+		void decompress(const std::string_view& in, bool fin, const std::function<void(const std::string_view&)>& out);
+
+	private:
+		void run(const char* in, size_t len, const std::function<void(const std::string_view&)>& out);
+
+		z_stream strm;
+		bool no_context_takeover;
+	};
+}
+
+#endif
@@ -0,0 +1,182 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of wscpp.
+ *
+ * wscpp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * wscpp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with wscpp.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <iostream>
+#include <stdexcept>
+#include "wsexecutor.h"
+
+using namespace std;
+
+// how many functions a strand runs before giving its worker back
+static const unsigned int STRAND_BATCH = 16;
+
+namespace ws {
+	static thread_local executor* current_executor = nullptr;
+	static thread_local unsigned int current_worker;
+
+	executor::executor(unsigned int num_threads) {
+		for (unsigned int i = 0; i < num_threads; i++) {
+			workers.emplace_back(make_unique<worker>());
+		}
+
+		for (unsigned int i = 0; i < num_threads; i++) {
+			workers[i]->t = thread([](executor* ex, unsigned int idx) { ex->run(idx); }, this, i);
+		}
+	}
+
+	executor::~executor() {
+		stop();
+	}
+
+	void executor::stop() {
+		{
+			lock_guard<mutex> guard(sleep_mutex);
+
+			stopping = true;
+		}
+
+		cv.notify_all();
+
+		for (auto& w : workers) {
+			if (w->t.joinable())
+				w->t.join();
+		}
+	}
+
+	void executor::post(function<void()> func) {
+		unsigned int idx;
+
+		if (current_executor == this)
+			idx = current_worker;
+		else
+			idx = next_worker++ % workers.size();
+
+		// counted before it's queued, so a worker never sees a task it hasn't been told about
+		{
+			lock_guard<mutex> guard(sleep_mutex);
+
+			queued++;
+		}
+
+		{
+			auto& w = *workers[idx];
+			lock_guard<mutex> guard(w.tasks_mutex);
+
+			w.tasks.push_back(move(func));
+		}
+
+		cv.notify_one();
+	}
+
+	bool executor::pop(unsigned int idx, function<void()>& func) {
+		{
+			auto& w = *workers[idx];
+			lock_guard<mutex> guard(w.tasks_mutex);
+
+			if (!w.tasks.empty()) {
+				func = move(w.tasks.front());
+				w.tasks.pop_front();
+				return true;
+			}
+		}
+
+		for (unsigned int i = 1; i < workers.size(); i++) {
+			auto& w = *workers[(idx + i) % workers.size()];
+			lock_guard<mutex> guard(w.tasks_mutex);
+
+			if (!w.tasks.empty()) {
+				func = move(w.tasks.back());
+				w.tasks.pop_back();
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	void executor::run(unsigned int idx) {
+		current_executor = this;
+		current_worker = idx;
+
+		while (true) {
+			function<void()> func;
+
+			if (pop(idx, func)) {
+				queued--;
+
+				try {
+					func();
+				} catch (const exception& e) {
+					cerr << e.what() << endl;
+				} catch (...) {
+				}
+
+				continue;
+			}
+
+			unique_lock<mutex> guard(sleep_mutex);
+
+			cv.wait(guard, [&]() { return queued != 0 || stopping; });
+
+			// finish off anything already posted before we go
+			if (stopping && queued == 0)
+				return;
+		}
+	}
+
+	void strand::post(function<void()> func) {
+		{
+			lock_guard<mutex> guard(tasks_mutex);
+
+			tasks.push_back(move(func));
+
+			if (scheduled)
+				return;
+
+			scheduled = true;
+		}
+
+		ex.post([s = shared_from_this()]() { s->run(); });
+	}
+
+	void strand::run() {
+		for (unsigned int i = 0; i < STRAND_BATCH; i++) {
+			function<void()> func;
+
+			{
+				lock_guard<mutex> guard(tasks_mutex);
+
+				if (tasks.empty()) {
+					scheduled = false;
+					return;
+				}
+
+				func = move(tasks.front());
+				tasks.pop_front();
+			}
+
+			try {
+				func();
+			} catch (const exception& e) {
+				cerr << e.what() << endl;
+			} catch (...) {
+			}
+		}
+
+		ex.post([s = shared_from_this()]() { s->run(); });
+	}
+}
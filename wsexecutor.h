@@ -0,0 +1,65 @@
+#pragma once
+
+#include <functional>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <atomic>
+
+#ifdef __MINGW32__
+#include "mingw.thread.h"
+#include "mingw.mutex.h"
+#include "mingw.condition_variable.h"
+#else
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#endif
+
+namespace ws {
+	// Pool of worker threads, each with its own queue. Work posted from a worker goes on
+	// that worker's queue, and idle workers steal from the others.
+	class executor {
+	public:
+		executor(unsigned int num_threads);
+		~executor();
+
+		void post(std::function<void()> func);
+		void stop();
+
+	private:
+		class worker {
+		public:
+			std::mutex tasks_mutex;
+			std::deque<std::function<void()>> tasks;
+			std::thread t;
+		};
+
+		void run(unsigned int idx);
+		bool pop(unsigned int idx, std::function<void()>& func);
+
+		std::vector<std::unique_ptr<worker>> workers;
+		std::atomic<unsigned int> next_worker = 0;
+		std::atomic<size_t> queued = 0;
+		std::mutex sleep_mutex;
+		std::condition_variable cv;
+		bool stopping = false;
+	};
+
+	// Runs the functions posted to it on an executor one at a time, in the order they
+	// were posted.
+	class strand : public std::enable_shared_from_this<strand> {
+	public:
+		strand(executor& ex) : ex(ex) { }
+
+		void post(std::function<void()> func);
+
+	private:
+		void run();
+
+		executor& ex;
+		std::mutex tasks_mutex;
+		std::deque<std::function<void()>> tasks;
+		bool scheduled = false;
+	};
+}
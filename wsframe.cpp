@@ -0,0 +1,479 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of wscpp.
+ *
+ * wscpp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * wscpp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with wscpp.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <string.h>
+#include <memory>
+#include <stdexcept>
+#include "wscpp.h"
+#include "wsmask.h"
+#include "wsdeflate.h"
+#include "wsutf8.h"
+
+using namespace std;
+
+// big enough that a typical read takes in several frames at once
+static const size_t RECV_BUFFER_SIZE = 16384;
+
+namespace ws {
+	class frame_parser_pimpl {
+	public:
+		frame_parser_pimpl(const parser_msg_handler& msg_handler, const parser_frame_handler& frame_handler,
+						   pmr::memory_resource* mr) :
+			msg_handler(msg_handler),
+			frame_handler(frame_handler),
+			buf(mr),
+			msgbuf(mr)
+		{ }
+
+		void feed(char* data, size_t len);
+		void append(const char* data, size_t len);
+		char* prepare(size_t& len);
+		void commit(size_t len);
+		size_t parse(char* data, size_t len);
+		void handle_frame(bool fin, bool compressed, enum opcode opcode, const char* mask_key, char* payload, size_t len);
+		void check_sequence(enum opcode opcode);
+		void stream_begin(bool fin, bool compressed, enum opcode opcode, const char* mask_key, uint64_t len);
+		void stream_data(char* data, size_t len);
+		void stream_deliver(const std::string_view& chunk, bool last);
+
+		parser_msg_handler msg_handler;
+		parser_frame_handler frame_handler;
+		std::pmr::string buf, msgbuf;
+		size_t buf_len = 0, pending = 0;
+		bool in_message = false, msg_compressed = false, check_utf8 = false;
+		enum opcode msg_opcode;
+		utf8_validator utf8;
+		parser_stream_handler stream_handler;
+		uint64_t stream_left = 0; // payload still to come of the frame being streamed
+		uint8_t stream_key[4];
+		size_t stream_key_off;
+		bool stream_masked, stream_fin, stream_started;
+		size_limits limits;
+		uint64_t msg_len = 0; // of the message so far, after decompression
+#ifdef HAVE_ZLIB
+		std::unique_ptr<inflater> inflate;
+#endif
+	};
+
+	frame_parser::frame_parser(const parser_msg_handler& msg_handler, const parser_frame_handler& frame_handler,
+							   pmr::memory_resource* mr) {
+		impl = new frame_parser_pimpl(msg_handler, frame_handler, mr ? mr : pmr::get_default_resource());
+	}
+
+	frame_parser::~frame_parser() {
+		delete impl;
+	}
+
+	void frame_parser::feed(const string_view& data) {
+		impl->append(data.data(), data.length());
+	}
+
+	void frame_parser::feed(char* data, size_t len) {
+		impl->feed(data, len);
+	}
+
+	char* frame_parser::prepare(size_t& len) {
+		return impl->prepare(len);
+	}
+
+	void frame_parser::commit(size_t len) {
+		impl->commit(len);
+	}
+
+	void frame_parser::inflate(unsigned int window_bits, bool no_context_takeover) {
+#ifdef HAVE_ZLIB
+		impl->inflate = make_unique<inflater>(window_bits, no_context_takeover);
+#else
+		throw runtime_error("wscpp was built without zlib, so can't do permessage-deflate.");
+#endif
+	}
+
+	void frame_parser::validate_utf8(bool enabled) {
+		impl->check_utf8 = enabled;
+	}
+
+	void frame_parser::stream(const parser_stream_handler& handler) {
+		impl->stream_handler = handler;
+	}
+
+	void frame_parser::limit(const size_limits& limits) {
+		impl->limits = limits;
+	}
+
+	size_t frame_parser::buffered() const {
+		return impl->buf_len + impl->msgbuf.length();
+	}
+
+	static void check_limit(uint64_t len, uint64_t limit, const char* msg) {
+		if (limit != 0 && len > limit)
+			throw protocol_error(1009, msg);
+	}
+
+	void frame_parser_pimpl::feed(char* data, size_t len) {
+		// if nothing's left over from last time, parse straight out of the caller's buffer
+		if (buf_len == 0) {
+			auto used = parse(data, len);
+
+			data += used;
+			len -= used;
+		}
+
+		append(data, len);
+	}
+
+	void frame_parser_pimpl::append(const char* data, size_t len) {
+		while (len > 0) {
+			size_t space;
+			auto ptr = prepare(space);
+			auto copy = min(space, len);
+
+			memcpy(ptr, data, copy);
+			commit(copy);
+
+			data += copy;
+			len -= copy;
+		}
+	}
+
+	char* frame_parser_pimpl::prepare(size_t& len) {
+		// make sure there's room for the whole of a frame we already have the header of
+		auto want = max(max(pending, buf_len + 1), RECV_BUFFER_SIZE);
+
+		if (buf.length() < want)
+			buf.resize(max(want, buf.length() * 2));
+
+		len = buf.length() - buf_len;
+
+		return buf.data() + buf_len;
+	}
+
+	void frame_parser_pimpl::commit(size_t len) {
+		buf_len += len;
+
+		auto used = parse(buf.data(), buf_len);
+
+		if (used == 0)
+			return;
+
+		buf_len -= used;
+
+		if (buf_len != 0)
+			memmove(buf.data(), buf.data() + used, buf_len);
+		else if (buf.length() > RECV_BUFFER_SIZE) {
+			// don't hang on to the memory from an unusually big frame
+			buf.resize(RECV_BUFFER_SIZE);
+			buf.shrink_to_fit();
+		}
+	}
+
+	size_t frame_parser_pimpl::parse(char* data, size_t data_len) {
+		size_t pos = 0;
+
+		while (true) {
+			auto p = (uint8_t*)data + pos;
+			size_t avail = data_len - pos;
+
+			pending = 0;
+
+			if (stream_left > 0) {
+				if (avail == 0)
+					return pos;
+
+				auto n = (size_t)min((uint64_t)avail, stream_left);
+
+				stream_data((char*)p, n);
+				pos += n;
+
+				continue;
+			}
+
+			if (avail < 2)
+				return pos;
+
+			bool fin = (p[0] & 0x80) != 0;
+			auto opcode = (enum opcode)(p[0] & 0xf);
+			bool mask = (p[1] & 0x80) != 0;
+			uint64_t len = p[1] & 0x7f;
+			size_t off = 2;
+
+			bool compressed = (p[0] & 0x40) != 0;
+
+			if (p[0] & 0x30)
+				throw protocol_error(1002, "Reserved bits set in frame header.");
+
+			// RSV1 marks the first frame of a compressed message
+#ifdef HAVE_ZLIB
+			if (compressed && (!inflate || (opcode != opcode::text && opcode != opcode::binary)))
+#else
+			if (compressed)
+#endif
+				throw protocol_error(1002, "RSV1 set without permessage-deflate.");
+
+			switch (opcode) {
+				case opcode::invalid:
+				case opcode::text:
+				case opcode::binary:
+					break;
+
+				case opcode::close:
+				case opcode::ping:
+				case opcode::pong:
+					if (!fin || len > 125)
+						throw protocol_error(1002, "Control frames must not be fragmented or longer than 125 bytes.");
+					break;
+
+				default:
+					throw protocol_error(1002, "Unrecognized opcode " + to_string((uint8_t)opcode) + ".");
+			}
+
+			if (len == 126) {
+				if (avail < off + 2)
+					return pos;
+
+				len = (p[2] << 8) | p[3];
+				off += 2;
+			} else if (len == 127) {
+				if (avail < off + 8)
+					return pos;
+
+				len = 0;
+
+				for (unsigned int i = 0; i < 8; i++) {
+					len <<= 8;
+					len |= p[off + i];
+				}
+
+				off += 8;
+
+				if (len & 0x8000000000000000)
+					throw protocol_error(1002, "Most significant bit of 64-bit frame length set.");
+			}
+
+			check_limit(len, limits.max_frame, "Frame too big.");
+
+			// compressed messages can only be checked as they're inflated
+			if (!((uint8_t)opcode & 0x8) && !(opcode == opcode::invalid ? msg_compressed : compressed))
+				check_limit((opcode == opcode::invalid && in_message ? msg_len : 0) + len, limits.max_message, "Message too big.");
+
+			const char* mask_key = nullptr;
+
+			if (mask) {
+				if (avail < off + 4)
+					return pos;
+
+				mask_key = (const char*)p + off;
+				off += 4;
+			}
+
+			if (stream_handler && !((uint8_t)opcode & 0x8)) {
+				stream_begin(fin, compressed, opcode, mask_key, len);
+				pos += off;
+
+				continue;
+			}
+
+			if (avail - off < len) {
+				// the whole frame has to be held in memory before it can be handled
+				if (len > SIZE_MAX / 2)
+					throw protocol_error(1009, "Frame too big.");
+
+				check_limit(off + len + msgbuf.length(), limits.max_buffer, "Too much data buffered.");
+
+				pending = off + (size_t)len;
+				return pos;
+			}
+
+			handle_frame(fin, compressed, opcode, mask_key, (char*)p + off, (size_t)len);
+
+			pos += off + (size_t)len;
+		}
+	}
+
+	void frame_parser_pimpl::handle_frame(bool fin, bool compressed, enum opcode opcode, const char* mask_key, char* data, size_t len) {
+		string_view payload(data, len);
+
+		if (mask_key) {
+			uint32_t key;
+
+			memcpy(&key, mask_key, sizeof(key));
+			mask_payload(data, data, len, key);
+		}
+
+		check_sequence(opcode);
+
+		if (frame_handler)
+			frame_handler(opcode, fin, payload);
+
+		// control frames can come in the middle of a fragmented message
+		if ((uint8_t)opcode & 0x8) {
+			if (msg_handler)
+				msg_handler(opcode, payload);
+
+			return;
+		}
+
+		if (fin && !in_message && !compressed) {
+			if (check_utf8 && opcode == opcode::text && !(utf8.feed(data, len) && utf8.finish()))
+				throw protocol_error(1007, "Invalid UTF-8 in text message.");
+
+			if (msg_handler)
+				msg_handler(opcode, payload);
+
+			return;
+		}
+
+		if (opcode != opcode::invalid) {
+			msg_opcode = opcode;
+			msg_compressed = compressed;
+			in_message = true;
+			msgbuf.clear();
+			msg_len = 0;
+		}
+
+		auto start = msgbuf.length();
+
+#ifdef HAVE_ZLIB
+		// the inflater has to see every message to keep its window right, even if nobody's listening
+		if (msg_compressed) {
+			inflate->decompress(payload, fin, [&](const string_view& sv) {
+				msg_len += sv.length();
+
+				check_limit(msg_len, limits.max_message, "Message too big.");
+				check_limit(msgbuf.length() + sv.length(), limits.max_buffer, "Too much data buffered.");
+
+				msgbuf.append(sv);
+			});
+		}
+#endif
+
+		if (!msg_compressed) {
+			msg_len += len;
+
+			if (msg_handler) {
+				check_limit(msgbuf.length() + len, limits.max_buffer, "Too much data buffered.");
+				msgbuf.append(payload);
+			}
+		}
+
+		if (check_utf8 && msg_opcode == opcode::text) {
+			auto text = msg_compressed ? string_view(msgbuf).substr(start) : payload;
+
+			if (!utf8.feed(text.data(), text.length()) || (fin && !utf8.finish()))
+				throw protocol_error(1007, "Invalid UTF-8 in text message.");
+		}
+
+		if (fin) {
+			in_message = false;
+
+			if (msg_handler)
+				msg_handler(msg_opcode, msgbuf);
+
+			msgbuf.clear();
+		}
+	}
+
+	void frame_parser_pimpl::check_sequence(enum opcode opcode) {
+		if (opcode == opcode::invalid) {
+			if (!in_message)
+				throw protocol_error(1002, "Continuation frame without a message to continue.");
+		} else if (!((uint8_t)opcode & 0x8) && in_message)
+			throw protocol_error(1002, "New message started before the last one finished.");
+	}
+
+	void frame_parser_pimpl::stream_begin(bool fin, bool compressed, enum opcode opcode, const char* mask_key, uint64_t len) {
+		check_sequence(opcode);
+
+		if (opcode != opcode::invalid) {
+			msg_opcode = opcode;
+			msg_compressed = compressed;
+			in_message = true;
+			stream_started = false;
+			msg_len = 0;
+		}
+
+		stream_fin = fin;
+		stream_left = len;
+		stream_masked = mask_key != nullptr;
+		stream_key_off = 0;
+
+		if (stream_masked)
+			memcpy(stream_key, mask_key, sizeof(stream_key));
+
+		// nothing else is coming for an empty frame, so deal with it now
+		if (len == 0)
+			stream_data(nullptr, 0);
+	}
+
+	void frame_parser_pimpl::stream_data(char* data, size_t len) {
+		if (stream_masked) {
+			uint8_t rotated[4];
+			uint32_t key;
+
+			// the key carries on from wherever the last piece of the frame stopped
+			for (unsigned int i = 0; i < 4; i++) {
+				rotated[i] = stream_key[(stream_key_off + i) % 4];
+			}
+
+			memcpy(&key, rotated, sizeof(key));
+			mask_payload(data, data, len, key);
+
+			stream_key_off += len;
+		}
+
+		stream_left -= len;
+
+		bool last = stream_fin && stream_left == 0;
+
+#ifdef HAVE_ZLIB
+		if (msg_compressed) {
+			inflate->decompress(string_view(data, len), last, [&](const string_view& sv) {
+				stream_deliver(sv, false);
+			});
+
+			stream_deliver(string_view(), last);
+
+			return;
+		}
+#endif
+
+		stream_deliver(string_view(data, len), last);
+	}
+
+	void frame_parser_pimpl::stream_deliver(const string_view& chunk, bool last) {
+		msg_len += chunk.length();
+
+		check_limit(msg_len, limits.max_message, "Message too big.");
+
+		if (check_utf8 && msg_opcode == opcode::text) {
+			if (!utf8.feed(chunk.data(), chunk.length()) || (last && !utf8.finish()))
+				throw protocol_error(1007, "Invalid UTF-8 in text message.");
+		}
+
+		if (last)
+			in_message = false;
+
+		// the first and last calls always happen, even if they're empty
+		if (chunk.empty() && stream_started && !last)
+			return;
+
+		auto opcode = stream_started ? opcode::invalid : msg_opcode;
+
+		stream_started = true;
+
+		stream_handler(opcode, chunk, last);
+	}
+}
@@ -0,0 +1,52 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of wscpp.
+ *
+ * wscpp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * wscpp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with wscpp.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "wsgather.h"
+
+using namespace std;
+
+namespace ws {
+	size_t total_length(const string_view* parts, size_t num_parts) {
+		size_t len = 0;
+
+		for (size_t i = 0; i < num_parts; i++) {
+			len += parts[i].length();
+		}
+
+		return len;
+	}
+
+#ifndef _WIN32
+	size_t gather(struct iovec* iov, size_t max, const string_view* parts, size_t num_parts, size_t skip) {
+		size_t num = 0;
+
+		for (size_t i = 0; i < num_parts && num < max; i++) {
+			if (skip >= parts[i].length()) {
+				skip -= parts[i].length();
+				continue;
+			}
+
+			iov[num].iov_base = (void*)(parts[i].data() + skip);
+			iov[num].iov_len = parts[i].length() - skip;
+			num++;
+			skip = 0;
+		}
+
+		return num;
+	}
+#endif
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <string_view>
+#include <stddef.h>
+
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
+namespace ws {
+	size_t total_length(const std::string_view* parts, size_t num_parts);
+
+#ifndef _WIN32
+	// Fills iov with what's left of parts after the first skip bytes, so a gathered write can
+	// carry on after a short one. Returns how many entries it used, no more than max.
+	size_t gather(struct iovec* iov, size_t max, const std::string_view* parts, size_t num_parts, size_t skip);
+#endif
+}
@@ -0,0 +1,184 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of wscpp.
+ *
+ * wscpp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * wscpp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with wscpp.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <string.h>
+#include "wsmask.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define MASK_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(MASK_X86) && (defined(__GNUC__) || defined(__clang__))
+#define TARGET(t) __attribute__((target(t)))
+#else
+#define TARGET(t)
+#endif
+
+using namespace std;
+
+typedef void (*mask_func)(char* dst, const char* src, size_t len, uint32_t key);
+
+namespace ws {
+	// Every kernel below works through whole multiples of four bytes, so the key is always
+	// back in phase when the next one takes over.
+
+	static void mask_scalar(char* dst, const char* src, size_t len, uint32_t key) {
+		uint64_t key64 = ((uint64_t)key << 32) | key;
+
+		while (len >= sizeof(uint64_t)) {
+			uint64_t v;
+
+			memcpy(&v, src, sizeof(v));
+			v ^= key64;
+			memcpy(dst, &v, sizeof(v));
+
+			src += sizeof(uint64_t);
+			dst += sizeof(uint64_t);
+			len -= sizeof(uint64_t);
+		}
+
+		auto k = (const char*)&key;
+
+		for (size_t i = 0; i < len; i++) {
+			dst[i] = src[i] ^ k[i % 4];
+		}
+	}
+
+#ifdef MASK_X86
+	TARGET("sse2")
+	static void mask_sse2(char* dst, const char* src, size_t len, uint32_t key) {
+		auto k = _mm_set1_epi32((int)key);
+
+		while (len >= sizeof(__m128i)) {
+			auto v = _mm_loadu_si128((const __m128i*)src);
+
+			_mm_storeu_si128((__m128i*)dst, _mm_xor_si128(v, k));
+
+			src += sizeof(__m128i);
+			dst += sizeof(__m128i);
+			len -= sizeof(__m128i);
+		}
+
+		mask_scalar(dst, src, len, key);
+	}
+
+	TARGET("avx2")
+	static void mask_avx2(char* dst, const char* src, size_t len, uint32_t key) {
+		auto k = _mm256_set1_epi32((int)key);
+
+		while (len >= sizeof(__m256i)) {
+			auto v = _mm256_loadu_si256((const __m256i*)src);
+
+			_mm256_storeu_si256((__m256i*)dst, _mm256_xor_si256(v, k));
+
+			src += sizeof(__m256i);
+			dst += sizeof(__m256i);
+			len -= sizeof(__m256i);
+		}
+
+		mask_scalar(dst, src, len, key);
+	}
+
+	TARGET("avx512f")
+	static void mask_avx512(char* dst, const char* src, size_t len, uint32_t key) {
+		auto k = _mm512_set1_epi32((int)key);
+
+		while (len >= sizeof(__m512i)) {
+			auto v = _mm512_loadu_si512((const void*)src);
+
+			_mm512_storeu_si512((void*)dst, _mm512_xor_si512(v, k));
+
+			src += sizeof(__m512i);
+			dst += sizeof(__m512i);
+			len -= sizeof(__m512i);
+		}
+
+		mask_scalar(dst, src, len, key);
+	}
+
+#ifdef _MSC_VER
+	static bool os_saves(uint64_t mask) {
+		int regs[4];
+
+		__cpuid(regs, 1);
+
+		// OSXSAVE
+		if (!(regs[2] & (1 << 27)))
+			return false;
+
+		return (_xgetbv(0) & mask) == mask;
+	}
+#endif
+
+	static mask_func pick_mask() {
+#ifdef _MSC_VER
+		int regs[4];
+
+		__cpuid(regs, 0);
+
+		if (regs[0] >= 7) {
+			__cpuidex(regs, 7, 0);
+
+			// AVX-512F, with the OS saving the ZMM registers
+			if ((regs[1] & (1 << 16)) && os_saves(0xe6))
+				return mask_avx512;
+
+			if ((regs[1] & (1 << 5)) && os_saves(0x6))
+				return mask_avx2;
+		}
+
+		__cpuid(regs, 1);
+
+		if (regs[3] & (1 << 26))
+			return mask_sse2;
+#else
+		__builtin_cpu_init();
+
+		if (__builtin_cpu_supports("avx512f"))
+			return mask_avx512;
+
+		if (__builtin_cpu_supports("avx2"))
+			return mask_avx2;
+
+		if (__builtin_cpu_supports("sse2"))
+			return mask_sse2;
+#endif
+
+		return mask_scalar;
+	}
+#endif
+
+	void mask_payload(char* dst, const char* src, size_t len, uint32_t key) {
+		// not worth going through the vector kernels for a small control frame
+		if (len < 16) {
+			mask_scalar(dst, src, len, key);
+			return;
+		}
+
+#ifdef MASK_X86
+		static const mask_func func = pick_mask();
+
+		func(dst, src, len, key);
+#else
+		mask_scalar(dst, src, len, key);
+#endif
+	}
+}
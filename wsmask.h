@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace ws {
+	// XORs len bytes of src with the repeating four-byte key and writes them to dst, which
+	// may be the same as src. key is the mask key as it appears on the wire, loaded with memcpy.
+	void mask_payload(char* dst, const char* src, size_t len, uint32_t key);
+}
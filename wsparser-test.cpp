@@ -0,0 +1,282 @@
+#include <wscpp.h>
+#include "wsutf8.h"
+#include <iostream>
+#include <random>
+#include <vector>
+#include <string.h>
+
+using namespace std;
+
+static unsigned int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { cerr << __FILE__ << ":" << __LINE__ << ": " << #cond << " failed" << endl; failures++; } } while (0)
+
+// a frame as a client would send it, masked unless mask is false
+static string make_frame(enum ws::opcode opcode, const string_view& payload, bool fin = true, bool mask = true) {
+	static const uint8_t key[4] = { 0x12, 0x34, 0x56, 0x78 };
+	string f;
+	auto len = payload.length();
+
+	f += (char)((fin ? 0x80 : 0) | (uint8_t)opcode);
+
+	if (len <= 125)
+		f += (char)((mask ? 0x80 : 0) | len);
+	else if (len < 0x10000) {
+		f += (char)((mask ? 0x80 : 0) | 126);
+		f += (char)(len >> 8);
+		f += (char)(len & 0xff);
+	} else {
+		f += (char)((mask ? 0x80 : 0) | 127);
+
+		for (int i = 7; i >= 0; i--) {
+			f += (char)((len >> (i * 8)) & 0xff);
+		}
+	}
+
+	if (!mask)
+		return f + string(payload);
+
+	f.append((const char*)key, sizeof(key));
+
+	for (size_t i = 0; i < len; i++) {
+		f += (char)(payload[i] ^ key[i % 4]);
+	}
+
+	return f;
+}
+
+struct parsed {
+	vector<pair<enum ws::opcode, string>> msgs;
+	uint16_t error = 0; // close status of the protocol_error thrown, if any
+};
+
+// feeds data to a fresh parser in chunks of at most chunk bytes
+static parsed parse(const string& data, size_t chunk, const ws::size_limits& limits = {}, bool utf8 = false) {
+	parsed ret;
+	ws::frame_parser p([&](enum ws::opcode opcode, const string_view& payload) {
+		ret.msgs.emplace_back(opcode, payload);
+	});
+
+	p.limit(limits);
+	p.validate_utf8(utf8);
+
+	try {
+		for (size_t i = 0; i < data.length(); i += chunk) {
+			p.feed(string_view(data).substr(i, chunk));
+		}
+	} catch (const ws::protocol_error& e) {
+		ret.error = e.status;
+	}
+
+	return ret;
+}
+
+static void test_split_frames() {
+	string big(70000, 'x'), medium(300, 'y');
+
+	for (size_t i = 0; i < big.length(); i++) {
+		big[i] = (char)('a' + (i % 26));
+	}
+
+	// a fragmented message with a ping in the middle, then 16- and 64-bit lengths
+	auto data = make_frame(ws::opcode::text, "Hel", false) +
+				make_frame(ws::opcode::ping, "ping") +
+				make_frame(ws::opcode::invalid, "lo") +
+				make_frame(ws::opcode::binary, medium) +
+				make_frame(ws::opcode::binary, big) +
+				make_frame(ws::opcode::text, "unmasked", true, false);
+
+	for (size_t chunk : { (size_t)1, (size_t)2, (size_t)3, (size_t)7, (size_t)13, (size_t)64, (size_t)4096, data.length() }) {
+		auto ret = parse(data, chunk);
+
+		CHECK(ret.error == 0);
+		CHECK(ret.msgs.size() == 5);
+
+		if (ret.msgs.size() != 5)
+			continue;
+
+		CHECK(ret.msgs[0].first == ws::opcode::ping && ret.msgs[0].second == "ping");
+		CHECK(ret.msgs[1].first == ws::opcode::text && ret.msgs[1].second == "Hello");
+		CHECK(ret.msgs[2].first == ws::opcode::binary && ret.msgs[2].second == medium);
+		CHECK(ret.msgs[3].first == ws::opcode::binary && ret.msgs[3].second == big);
+		CHECK(ret.msgs[4].first == ws::opcode::text && ret.msgs[4].second == "unmasked");
+	}
+
+	// every split point of two frames
+	data = make_frame(ws::opcode::text, medium) + make_frame(ws::opcode::binary, "abc");
+
+	for (size_t split = 1; split < data.length(); split++) {
+		parsed ret;
+		ws::frame_parser p([&](enum ws::opcode opcode, const string_view& payload) {
+			ret.msgs.emplace_back(opcode, payload);
+		});
+
+		p.feed(string_view(data).substr(0, split));
+		p.feed(string_view(data).substr(split));
+
+		CHECK(ret.msgs.size() == 2 && ret.msgs[0].second == medium && ret.msgs[1].second == "abc");
+	}
+}
+
+static void test_limits() {
+	string payload(100, 'z');
+	ws::size_limits limits;
+
+	limits.max_frame = 100;
+	CHECK(parse(make_frame(ws::opcode::binary, payload), 1, limits).error == 0);
+	CHECK(parse(make_frame(ws::opcode::binary, payload + "!"), 1, limits).error == 1009);
+
+	// the frame header alone is enough to reject it
+	CHECK(parse(make_frame(ws::opcode::binary, string(70000, 'z')).substr(0, 14), 14, limits).error == 1009);
+
+	limits = {};
+	limits.max_message = 150;
+	CHECK(parse(make_frame(ws::opcode::binary, payload, false) + make_frame(ws::opcode::invalid, string(50, 'z')), 7, limits).error == 0);
+	CHECK(parse(make_frame(ws::opcode::binary, payload, false) + make_frame(ws::opcode::invalid, string(51, 'z')), 7, limits).error == 1009);
+
+	limits = {};
+	limits.max_buffer = 1000;
+	CHECK(parse(make_frame(ws::opcode::binary, string(2000, 'z')), 100, limits).error == 1009);
+
+	// a 64-bit length with the top bit set
+	string huge = "\x82\xff\x80";
+	huge += string(7, '\0');
+	CHECK(parse(huge, 1).error == 1002);
+
+	CHECK(parse(make_frame(ws::opcode::ping, string(126, 'p')), 1).error == 1002); // control frames are at most 125
+	CHECK(parse(make_frame(ws::opcode::ping, "p", false), 1).error == 1002); // and can't be fragmented
+	CHECK(parse(make_frame(ws::opcode::invalid, "cont"), 1).error == 1002); // continuation of nothing
+	CHECK(parse(make_frame(ws::opcode::text, "a", false) + make_frame(ws::opcode::text, "b"), 1).error == 1002);
+	CHECK(parse("\xc1\x80" + string(4, '\0'), 1).error == 1002); // RSV1 without deflate
+	CHECK(parse("\x83\x80" + string(4, '\0'), 1).error == 1002); // reserved opcode
+}
+
+static void test_parser_utf8() {
+	// a character split between fragments is fine, an invalid one isn't
+	auto data = make_frame(ws::opcode::text, "caf\xc3", false) + make_frame(ws::opcode::invalid, "\xa9!");
+
+	for (size_t chunk : { (size_t)1, data.length() }) {
+		auto ret = parse(data, chunk, {}, true);
+
+		CHECK(ret.error == 0 && ret.msgs.size() == 1 && ret.msgs[0].second == "caf\xc3\xa9!");
+		CHECK(parse(make_frame(ws::opcode::text, string(40, 'a') + "\xed\xa0\x80"), chunk, {}, true).error == 1007);
+		CHECK(parse(make_frame(ws::opcode::text, "trunc\xe2\x82"), chunk, {}, true).error == 1007);
+		CHECK(parse(make_frame(ws::opcode::binary, "\xff"), chunk, {}, true).error == 0);
+	}
+}
+
+// The validator only uses its vector kernels on 32 bytes or more at once, so feeding the whole
+// buffer goes through them, and feeding a byte at a time is all scalar.
+static bool validate(const string& s, size_t chunk) {
+	ws::utf8_validator v;
+
+	for (size_t i = 0; i < s.length(); i += chunk) {
+		auto part = string_view(s).substr(i, chunk);
+
+		if (!v.feed(part.data(), part.length())) {
+			v.finish();
+			return false;
+		}
+	}
+
+	return v.finish();
+}
+
+static void check_utf8(const string& s, bool expected) {
+	auto whole = validate(s, s.length() == 0 ? 1 : s.length());
+	auto bytewise = validate(s, 1);
+
+	if (whole != expected || bytewise != expected) {
+		cerr << "UTF-8 mismatch at length " << s.length() << ": expected " << expected << ", got " << whole << " whole and "
+			 << bytewise << " bytewise" << endl;
+		failures++;
+	}
+}
+
+static void test_utf8() {
+	static const struct {
+		const char* seq;
+		bool valid;
+	} cases[] = {
+		{ "\x7f", true },
+		{ "\xc2\x80", true },
+		{ "\xdf\xbf", true },
+		{ "\xe0\xa0\x80", true },
+		{ "\xed\x9f\xbf", true }, // just below the surrogates
+		{ "\xee\x80\x80", true }, // just above them
+		{ "\xef\xbf\xbf", true },
+		{ "\xf0\x90\x80\x80", true },
+		{ "\xf4\x8f\xbf\xbf", true }, // U+10FFFF
+		{ "\xc0\x80", false }, // overlong
+		{ "\xc1\xbf", false },
+		{ "\xe0\x80\x80", false },
+		{ "\xe0\x9f\xbf", false },
+		{ "\xf0\x80\x80\x80", false },
+		{ "\xf0\x8f\xbf\xbf", false },
+		{ "\xed\xa0\x80", false }, // surrogates
+		{ "\xed\xbf\xbf", false },
+		{ "\xf4\x90\x80\x80", false }, // above U+10FFFF
+		{ "\xf5\x80\x80\x80", false },
+		{ "\xff", false },
+		{ "\x80", false }, // stray continuation
+		{ "\xc2\x80\x80", false },
+		{ "\xc2", false }, // truncated
+		{ "\xe2\x82", false },
+		{ "\xf0\x9f\x98", false },
+		{ "\xe2\x28\xa1", false },
+		{ "\xf0\x9f\x98\x28", false },
+	};
+
+	// put each one at every offset, so it crosses 16- and 32-byte boundaries, both at the end of
+	// the buffer and with more after it
+	for (const auto& c : cases) {
+		for (size_t off = 0; off < 70; off++) {
+			string pad(off, 'a');
+
+			check_utf8(pad + c.seq, c.valid);
+			check_utf8(pad + c.seq + string(70 - off, 'b'), c.valid);
+			check_utf8(pad + "\xc3\xa9" + c.seq + "\xe2\x82\xac" + string(40, 'c'), c.valid);
+		}
+	}
+
+	// random mixes of valid characters and stray bytes, compared between the two paths
+	static const char* const pieces[] = { "a", "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80", "\xed\x9f\xbf", "\xf4\x8f\xbf\xbf" };
+	mt19937 rng(1);
+
+	for (unsigned int i = 0; i < 20000; i++) {
+		string s;
+		auto n = rng() % 40;
+
+		for (unsigned int j = 0; j < n; j++) {
+			s += pieces[rng() % (sizeof(pieces) / sizeof(pieces[0]))];
+		}
+
+		if (i % 2 && !s.empty())
+			s[rng() % s.length()] = (char)(rng() & 0xff);
+
+		auto bytewise = validate(s, 1);
+
+		for (size_t chunk : { s.length() == 0 ? (size_t)1 : s.length(), (size_t)33, (size_t)17 }) {
+			if (validate(s, chunk) != bytewise) {
+				cerr << "UTF-8 mismatch on random input " << i << " in chunks of " << chunk << endl;
+				failures++;
+			}
+		}
+	}
+}
+
+int main() {
+	test_split_frames();
+	test_limits();
+	test_parser_utf8();
+	test_utf8();
+
+	if (failures != 0) {
+		cerr << failures << " checks failed." << endl;
+		return 1;
+	}
+
+	cout << "All checks passed." << endl;
+
+	return 0;
+}
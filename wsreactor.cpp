@@ -0,0 +1,1028 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of wscpp.
+ *
+ * wscpp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * wscpp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with wscpp.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifdef __linux__
+
+#include <string>
+#include <iostream>
+#include <algorithm>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "wscpp.h"
+#include "wsserver-impl.h"
+#include "wsuring.h"
+#include "wsgather.h"
+
+using namespace std;
+
+namespace ws {
+	// created one at a time by create_reactors, so the count so far is our index
+	reactor::reactor(server_pimpl& serv, bool sharded) : reg((unsigned int)serv.reactors.size() + 1), serv(serv), sharded(sharded) {
+	}
+
+	// called by start, as once we're listening connections can arrive
+	void reactor::listen() {
+		// the kernel hashes incoming connections across every socket bound with SO_REUSEPORT
+		if (sharded)
+			listen_sock = serv.open_listener(true);
+	}
+
+	reactor::~reactor() {
+		if (listen_sock != -1)
+			close(listen_sock);
+	}
+
+	void reactor::stop_listening() {
+		if (listen_sock != -1)
+			shutdown(listen_sock, SHUT_RDWR);
+	}
+
+	void reactor::accept_client(int newsock) {
+		auto& ct = reg.add(&newsock, serv.parent, serv.msg_handler, serv.conn_handler, serv.disconn_handler);
+
+		try {
+			add(*ct.impl);
+		} catch (const exception& e) {
+			cerr << e.what() << endl;
+
+			reg.remove(ct);
+		}
+	}
+
+	// called on the loop, once a read has left the server over memory_budget
+	void reactor::pause_reads(client_thread_pimpl& ctp) {
+		paused.push_back(&ctp);
+		serv.paused_reads++;
+
+		set_reading(ctp, false);
+
+		// in case everything drained while we were deciding
+		serv.budget_drained();
+	}
+
+	void reactor::wake_reads() {
+		if (!resume_wanted.exchange(true))
+			wake();
+	}
+
+	thread_local reactor* reactor::loop = nullptr;
+
+	bool reactor::on_loop_thread() {
+		return loop != nullptr;
+	}
+
+	bool reactor::post(function<void()> func) {
+		{
+			lock_guard<mutex> guard(posted_mutex);
+
+			if (posted_closed)
+				return false;
+
+			posted.push_back(move(func));
+		}
+
+		wake();
+
+		return true;
+	}
+
+	// Once the loop's finished, nothing else posted would ever run, so anything that's waiting
+	// for it is run now, and post refuses any more.
+	void reactor::close_posted() {
+		vector<function<void()>> funcs;
+
+		{
+			lock_guard<mutex> guard(posted_mutex);
+
+			posted_closed = true;
+			funcs.swap(posted);
+		}
+
+		for (auto& f : funcs) {
+			f();
+		}
+	}
+
+	void reactor::run_posted() {
+		vector<function<void()>> funcs;
+
+		{
+			lock_guard<mutex> guard(posted_mutex);
+
+			funcs.swap(posted);
+		}
+
+		for (auto& f : funcs) {
+			f();
+		}
+	}
+
+	void reactor::resume_reads() {
+		if (!resume_wanted.exchange(false))
+			return;
+
+		for (auto ctp : paused) {
+			set_reading(*ctp, true);
+		}
+
+		serv.paused_reads -= paused.size();
+		paused.clear();
+	}
+
+	epoll_reactor::epoll_reactor(server_pimpl& serv, bool sharded) : reactor(serv, sharded) {
+		struct epoll_event ev;
+
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (epfd == -1)
+			throw sockets_error("epoll_create1");
+
+		wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (wake_fd == -1) {
+			sockets_error err("eventfd");
+
+			close(epfd);
+			throw err;
+		}
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = nullptr;
+
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, wake_fd, &ev) == -1) {
+			sockets_error err("epoll_ctl");
+
+			close(wake_fd);
+			close(epfd);
+			throw err;
+		}
+	}
+
+	// Not done by the constructor, as the loop can call into the server, which mustn't happen
+	// until create_reactors has made all of them.
+	void epoll_reactor::start() {
+		if (t.joinable())
+			return;
+
+		listen();
+
+		if (listen_sock != -1) {
+			struct epoll_event ev;
+			int flags = fcntl(listen_sock, F_GETFL, 0);
+
+			// so we can drain the accept queue without blocking the loop
+			if (flags == -1 || fcntl(listen_sock, F_SETFL, flags | O_NONBLOCK) != 0)
+				throw runtime_error("fcntl failed");
+
+			ev.events = EPOLLIN;
+			ev.data.ptr = &listen_sock;
+
+			if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_sock, &ev) == -1)
+				throw sockets_error("epoll_ctl");
+		}
+
+		t = thread([](epoll_reactor* r) {
+			r->run();
+			r->close_posted();
+		}, this);
+	}
+
+	void epoll_reactor::stop() {
+		if (t.joinable()) {
+			stopping = true;
+			wake();
+
+			t.join();
+		}
+	}
+
+	epoll_reactor::~epoll_reactor() {
+		stop();
+
+		close(wake_fd);
+		close(epfd);
+	}
+
+	void epoll_reactor::wake() {
+		uint64_t val = 1;
+
+		if (write(wake_fd, &val, sizeof(val)) == -1) {
+			// eventfd counter can't overflow with a single write
+		}
+	}
+
+	void epoll_reactor::add(client_thread_pimpl& ctp) {
+		struct epoll_event ev;
+
+		int flags = fcntl(ctp.fd, F_GETFL, 0);
+
+		if (flags == -1)
+			throw runtime_error("fcntl returned -1");
+
+		if (fcntl(ctp.fd, F_SETFL, flags | O_NONBLOCK) != 0)
+			throw runtime_error("fcntl failed");
+
+		ctp.r = this;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = &ctp;
+
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, ctp.fd, &ev) == -1)
+			throw sockets_error("epoll_ctl");
+	}
+
+	// Queues what's left of the parts after the first off bytes have gone. If the caller's frame is
+	// shared we keep a reference to it, otherwise we have to copy the remainder.
+	static void enqueue(server_pimpl& serv, client_thread_pimpl& ctp, const string_view* parts, size_t num_parts, size_t len,
+						const frame_ptr& frame, size_t off) {
+		if (ctp.sendq.empty())
+			ctp.sendq_off = frame ? off : 0;
+
+		if (frame)
+			ctp.sendq.push_back(frame);
+		else {
+			auto f = allocate_shared<pmr::string>(pmr::polymorphic_allocator<pmr::string>(serv.mr));
+			auto skip = off;
+
+			f->reserve(len - off);
+
+			for (size_t i = 0; i < num_parts; i++) {
+				if (skip >= parts[i].length()) {
+					skip -= parts[i].length();
+					continue;
+				}
+
+				f->append(parts[i].substr(skip));
+				skip = 0;
+			}
+
+			ctp.sendq.push_back(f);
+		}
+
+		ctp.sendq_bytes += len - off;
+		serv.buffered_out += len - off;
+	}
+
+	static size_t fill_iov(client_thread_pimpl& ctp, struct iovec* iov, size_t max) {
+		size_t num = 0;
+
+		for (const auto& f : ctp.sendq) {
+			if (num == max)
+				break;
+
+			size_t off = num == 0 ? ctp.sendq_off : 0;
+
+			iov[num].iov_base = (void*)(f->data() + off);
+			iov[num].iov_len = f->length() - off;
+			num++;
+		}
+
+		return num;
+	}
+
+	// Empty frames are never left at the front, so there's always something to send.
+	static void pop_holes(client_thread_pimpl& ctp) {
+		while (!ctp.sendq.empty() && ctp.sendq.front()->empty()) {
+			ctp.sendq.pop_front();
+			ctp.sendq_popped++;
+			ctp.sendq_holes--;
+		}
+	}
+
+	static void consume(server_pimpl& serv, client_thread_pimpl& ctp, size_t bytes) {
+		ctp.sendq_bytes -= bytes;
+		serv.buffered_out -= bytes;
+
+		while (bytes > 0) {
+			auto left = ctp.sendq.front()->length() - ctp.sendq_off;
+
+			if (bytes < left) {
+				ctp.sendq_off += bytes;
+				return;
+			}
+
+			bytes -= left;
+
+			if (ctp.sendq.front()->empty())
+				ctp.sendq_holes--;
+
+			ctp.sendq.pop_front();
+			ctp.sendq_popped++;
+			ctp.sendq_off = 0;
+		}
+
+		pop_holes(ctp);
+	}
+
+	static void drop_sendq(server_pimpl& serv, client_thread_pimpl& ctp) {
+		serv.buffered_out -= ctp.sendq_bytes;
+		ctp.sendq_popped += ctp.sendq.size();
+		ctp.sendq.clear();
+		ctp.sendq_keys.clear();
+		ctp.sendq_off = ctp.sendq_bytes = ctp.sendq_holes = 0;
+	}
+
+	// Takes the empty frames out of sendq, other than among the first pinned, and renumbers the keys to match.
+	static void compact_sendq(client_thread_pimpl& ctp, size_t pinned) {
+		vector<uint64_t> nums(ctp.sendq.size());
+		size_t kept = 0;
+
+		ctp.sendq_holes = 0;
+
+		for (size_t i = 0; i < ctp.sendq.size(); i++) {
+			nums[i] = ctp.sendq_popped + kept;
+
+			if (i < pinned || !ctp.sendq[i]->empty()) {
+				if (ctp.sendq[i]->empty())
+					ctp.sendq_holes++;
+
+				ctp.sendq[kept++] = move(ctp.sendq[i]);
+			}
+		}
+
+		ctp.sendq.resize(kept);
+
+		// keys of frames that have gone keep their numbers, which are still too low to match anything
+		for (auto& k : ctp.sendq_keys) {
+			if (k.second >= ctp.sendq_popped)
+				k.second = nums[k.second - ctp.sendq_popped];
+		}
+	}
+
+	// Drops the last frame queued with the same key, unless that's among the first pinned frames
+	// of sendq, which have started going out, or has gone already, and queues frame at the back, so
+	// it can't overtake anything sent after the one it replaces. The old one's left as an empty
+	// frame, as taking it out would renumber everything after it, until there are enough of them.
+	static bool conflate(server_pimpl& serv, client_thread_pimpl& ctp, const string_view& key, const frame_ptr& frame,
+						 size_t pinned) {
+		static const frame_ptr hole = make_shared<const pmr::string>();
+		auto it = ctp.sendq_keys.find(key);
+
+		if (it == ctp.sendq_keys.end() || it->second < ctp.sendq_popped + pinned)
+			return false;
+
+		auto& f = ctp.sendq[it->second - ctp.sendq_popped];
+		auto diff = frame->length() - f->length(); // wraps round if it's shrunk, which adds up the same
+
+		ctp.sendq_bytes += diff;
+		serv.buffered_out += diff;
+
+		// nothing's been queued since, so it can stay where it is
+		if (&f == &ctp.sendq.back()) {
+			f = frame;
+			return true;
+		}
+
+		f = hole;
+		ctp.sendq_holes++;
+		ctp.sendq.push_back(frame);
+		it->second = ctp.sendq_popped + ctp.sendq.size() - 1;
+		pop_holes(ctp);
+
+		if (ctp.sendq_holes > (ctp.sendq.size() / 2) + 16)
+			compact_sendq(ctp, pinned);
+
+		return true;
+	}
+
+	// notes that the frame just put on the back of sendq has key
+	static void remember_key(client_thread_pimpl& ctp, const string_view& key) {
+		// keys of frames that have gone are only cleared out once there are enough of them
+		if (ctp.sendq_keys.size() > (ctp.sendq.size() * 2) + 16) {
+			for (auto it = ctp.sendq_keys.begin(); it != ctp.sendq_keys.end(); ) {
+				if (it->second < ctp.sendq_popped)
+					it = ctp.sendq_keys.erase(it);
+				else
+					it++;
+			}
+		}
+
+		auto num = ctp.sendq_popped + ctp.sendq.size() - 1;
+		auto it = ctp.sendq_keys.find(key);
+
+		if (it == ctp.sendq_keys.end())
+			ctp.sendq_keys.emplace(key, num);
+		else
+			it->second = num;
+	}
+
+	send_status epoll_reactor::send(client_thread_pimpl& ctp, const string_view* parts, size_t num_parts, const frame_ptr& frame,
+									const string_view& key) {
+		bool changed, slow;
+		auto len = total_length(parts, num_parts);
+
+		{
+			lock_guard<mutex> guard(ctp.send_mutex);
+			size_t off = 0;
+
+			if (ctp.closing) // gone, but for_each can still see it
+				return send_status::ok;
+
+			// only write directly if that can't overtake anything already queued
+			if (ctp.sendq.empty()) {
+				struct iovec iov[64];
+				struct msghdr msg;
+
+				memset(&msg, 0, sizeof(msg));
+				msg.msg_iov = iov;
+				msg.msg_iovlen = gather(iov, sizeof(iov) / sizeof(iov[0]), parts, num_parts, 0);
+
+				auto bytes = sendmsg(ctp.fd, &msg, MSG_NOSIGNAL);
+
+				if (bytes == -1) {
+					int err = errno;
+
+					if (err != EWOULDBLOCK && err != EAGAIN)
+						throw runtime_error("send failed (" + to_string(err) + ").");
+				} else
+					off = bytes;
+
+				if (off == len)
+					return send_status::ok;
+
+				want_write(ctp, true);
+			}
+
+			// only the front can have been partly written
+			if (key.empty() || !conflate(serv, ctp, key, frame, ctp.sendq_off > 0 ? 1 : 0)) {
+				enqueue(serv, ctp, parts, num_parts, len, frame, off);
+
+				if (!key.empty())
+					remember_key(ctp, key);
+			}
+
+			changed = ctp.check_water(ctp.sendq_bytes);
+			slow = ctp.slow;
+		}
+
+		if (changed)
+			ctp.backpressure(true);
+
+		return slow ? send_status::backpressure : send_status::ok;
+	}
+
+	void epoll_reactor::flush(client_thread_pimpl& ctp) {
+		bool changed;
+
+		{
+			lock_guard<mutex> guard(ctp.send_mutex);
+			struct iovec iov[64];
+			struct msghdr msg;
+
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+
+			while (!ctp.sendq.empty()) {
+				msg.msg_iovlen = fill_iov(ctp, iov, sizeof(iov) / sizeof(iov[0]));
+
+				auto bytes = sendmsg(ctp.fd, &msg, MSG_NOSIGNAL);
+
+				if (bytes == -1) {
+					int err = errno;
+
+					if (err == EWOULDBLOCK || err == EAGAIN)
+						break;
+
+					throw runtime_error("send failed (" + to_string(err) + ").");
+				}
+
+				consume(serv, ctp, bytes);
+			}
+
+			if (ctp.sendq.empty())
+				want_write(ctp, false);
+
+			changed = ctp.check_water(ctp.sendq_bytes);
+		}
+
+		serv.budget_drained();
+
+		if (changed)
+			ctp.backpressure(false);
+	}
+
+	void epoll_reactor::set_reading(client_thread_pimpl& ctp, bool on) {
+		lock_guard<mutex> guard(ctp.send_mutex);
+
+		ctp.read_paused = !on;
+		want_write(ctp, !ctp.sendq.empty());
+	}
+
+	void epoll_reactor::want_write(client_thread_pimpl& ctp, bool on) {
+		struct epoll_event ev;
+
+		ev.events = (ctp.read_paused ? 0 : (uint32_t)EPOLLIN) | (on ? (uint32_t)EPOLLOUT : 0);
+		ev.data.ptr = &ctp;
+
+		// ENOENT means the connection is already being torn down
+		if (epoll_ctl(epfd, EPOLL_CTL_MOD, ctp.fd, &ev) == -1 && errno != ENOENT)
+			throw sockets_error("epoll_ctl");
+	}
+
+	void epoll_reactor::run() {
+		struct epoll_event events[64];
+
+		loop = this;
+
+		while (true) {
+			int num = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), -1);
+
+			if (num == -1) {
+				if (errno == EINTR)
+					continue;
+
+				cerr << sockets_error("epoll_wait").what() << endl;
+				return;
+			}
+
+			for (int i = 0; i < num; i++) {
+				if (!events[i].data.ptr) {
+					uint64_t val;
+
+					if (read(wake_fd, &val, sizeof(val)) == -1) {
+						// EAGAIN if another wakeup already drained it
+					}
+
+					if (stopping)
+						return;
+
+					resume_reads();
+					run_posted();
+
+					continue;
+				}
+
+				if (events[i].data.ptr == &listen_sock) {
+					handle_accept();
+					continue;
+				}
+
+				handle_event(*(client_thread_pimpl*)events[i].data.ptr, events[i].events);
+			}
+		}
+	}
+
+	void epoll_reactor::handle_accept() {
+		while (true) {
+			int newsock = accept4(listen_sock, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+			if (newsock == -1) {
+				int err = errno;
+
+				if (err == EINTR || err == ECONNABORTED)
+					continue;
+
+				if (err == EINVAL) { // server::close has shut the listener down
+					epoll_ctl(epfd, EPOLL_CTL_DEL, listen_sock, nullptr);
+					return;
+				}
+
+				if (err != EWOULDBLOCK && err != EAGAIN)
+					cerr << sockets_error("accept").what() << endl;
+
+				return;
+			}
+
+			accept_client(newsock);
+		}
+	}
+
+	void epoll_reactor::handle_event(client_thread_pimpl& ctp, uint32_t events) {
+		exception_ptr except;
+
+		try {
+			if (events & EPOLLOUT)
+				flush(ctp);
+
+			if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				ctp.on_readable();
+		} catch (...) {
+			except = current_exception();
+		}
+
+		if (ctp.open && !except) {
+			if (!ctp.read_paused && serv.should_pause(ctp))
+				pause_reads(ctp);
+
+			return;
+		}
+
+		ctp.open = false;
+
+		epoll_ctl(epfd, EPOLL_CTL_DEL, ctp.fd, nullptr);
+
+		if (except)
+			ctp.send_close(except);
+
+		remove(ctp, except);
+	}
+
+	void reactor::remove(client_thread_pimpl& ctp, const exception_ptr& except) {
+		if (ctp.read_paused) {
+			auto it = find(paused.begin(), paused.end(), &ctp);
+
+			if (it != paused.end()) {
+				paused.erase(it);
+				serv.paused_reads--;
+			}
+		}
+
+		// with a handler pool, this waits behind whatever is still queued for the connection
+		if (ctp.handler_strand) {
+			ctp.handler_strand->post([this, &ctp, except]() {
+				finish(ctp, except ? except : ctp.handler_except);
+			});
+		} else
+			finish(ctp, except);
+	}
+
+	void reactor::finish(client_thread_pimpl& ctp, const exception_ptr& except) {
+		try {
+			if (ctp.disconn_handler)
+				ctp.disconn_handler(ctp.parent, except);
+		} catch (const exception& e) {
+			cerr << e.what() << endl;
+		} catch (...) {
+		}
+
+		// this may be put off while for_each is running, so the registry calls budget_drained
+		reg.remove(ctp.parent);
+	}
+
+#ifdef HAVE_IO_URING
+	static const uint64_t TAG_WAKE = 0;
+	static const uint64_t TAG_RECV = 1;
+	static const uint64_t TAG_SEND = 2;
+	static const uint64_t TAG_ACCEPT = 3;
+	static const uint64_t TAG_CANCEL = 4;
+	static const uint64_t TAG_MASK = 7;
+
+	static const unsigned int URING_ENTRIES = 256;
+	static const unsigned int URING_BUFFERS = 256;
+	static const unsigned int URING_BUFFER_SIZE = 16384;
+
+	uring_reactor::uring_reactor(server_pimpl& serv, bool sharded) : reactor(serv, sharded), ring(URING_ENTRIES) {
+		ring.setup_buf_ring(0, URING_BUFFERS, URING_BUFFER_SIZE);
+
+		wake_fd = eventfd(0, EFD_CLOEXEC);
+		if (wake_fd == -1)
+			throw sockets_error("eventfd");
+	}
+
+	// as for epoll_reactor::start
+	void uring_reactor::start() {
+		if (t.joinable())
+			return;
+
+		listen();
+
+		t = thread([](uring_reactor* r) {
+			r->run();
+			r->close_posted();
+		}, this);
+	}
+
+	void uring_reactor::stop() {
+		if (t.joinable()) {
+			stopping = true;
+			wake();
+
+			t.join();
+		}
+	}
+
+	uring_reactor::~uring_reactor() {
+		stop();
+
+		close(wake_fd);
+	}
+
+	void uring_reactor::wake() {
+		uint64_t val = 1;
+
+		if (write(wake_fd, &val, sizeof(val)) == -1) {
+			// eventfd counter can't overflow with a single write
+		}
+	}
+
+	void uring_reactor::queue(vector<client_thread_pimpl*>& list, client_thread_pimpl& ctp) {
+		bool was_empty;
+
+		{
+			lock_guard<mutex> guard(pending_mutex);
+
+			was_empty = pending_adds.empty() && pending_sends.empty();
+			list.push_back(&ctp);
+		}
+
+		// the loop drains the queues before it next waits, so it only needs waking from outside
+		if (was_empty && loop != this)
+			wake();
+	}
+
+	void uring_reactor::add(client_thread_pimpl& ctp) {
+		ctp.r = this;
+
+		queue(pending_adds, ctp);
+	}
+
+	send_status uring_reactor::send(client_thread_pimpl& ctp, const string_view* parts, size_t num_parts, const frame_ptr& frame,
+									const string_view& key) {
+		bool changed, slow, start;
+
+		{
+			lock_guard<mutex> guard(ctp.send_mutex);
+
+			if (ctp.closing)
+				return send_status::ok;
+
+			// the kernel's reading from whatever the sendmsg in flight covers
+			size_t pinned = ctp.send_inflight ? (size_t)ctp.send_msg.msg_iovlen : (ctp.sendq_off > 0 ? 1 : 0);
+
+			if (key.empty() || !conflate(serv, ctp, key, frame, pinned)) {
+				enqueue(serv, ctp, parts, num_parts, total_length(parts, num_parts), frame, 0);
+
+				if (!key.empty())
+					remember_key(ctp, key);
+			}
+
+			start = !ctp.send_pending && !ctp.send_inflight;
+
+			if (start)
+				ctp.send_pending = true;
+
+			changed = ctp.check_water(ctp.sendq_bytes);
+			slow = ctp.slow;
+		}
+
+		if (start)
+			queue(pending_sends, ctp);
+
+		if (changed)
+			ctp.backpressure(true);
+
+		return slow ? send_status::backpressure : send_status::ok;
+	}
+
+	void uring_reactor::run() {
+		loop = this;
+
+		ring.prep_read(wake_fd, &wake_val, sizeof(wake_val), TAG_WAKE);
+
+		if (listen_sock != -1)
+			ring.prep_accept_multishot(listen_sock, TAG_ACCEPT);
+
+		while (true) {
+			{
+				lock_guard<mutex> guard(pending_mutex);
+
+				adds.swap(pending_adds);
+				sends.swap(pending_sends);
+			}
+
+			for (auto ctp : adds) {
+				ring.prep_recv_multishot(ctp->fd, (uint64_t)(uintptr_t)ctp | TAG_RECV);
+				ctp->recv_armed = true;
+			}
+
+			for (auto ctp : sends) {
+				start_send(*ctp);
+			}
+
+			adds.clear();
+			sends.clear();
+
+			// everything queued during the last pass goes to the kernel in one go
+			try {
+				ring.submit(1);
+			} catch (const exception& e) {
+				cerr << e.what() << endl;
+				return;
+			}
+
+			while (auto cqe = ring.peek_cqe()) {
+				auto user_data = cqe->user_data;
+				int res = cqe->res;
+				uint32_t flags = cqe->flags;
+
+				ring.cqe_seen();
+
+				auto ctp = (client_thread_pimpl*)(uintptr_t)(user_data & ~TAG_MASK);
+
+				switch (user_data & TAG_MASK) {
+					case TAG_WAKE:
+						if (stopping)
+							return;
+
+						ring.prep_read(wake_fd, &wake_val, sizeof(wake_val), TAG_WAKE);
+						resume_reads();
+						run_posted();
+						break;
+
+					case TAG_RECV:
+						handle_recv(*ctp, res, flags);
+						break;
+
+					case TAG_SEND:
+						handle_send(*ctp, res);
+						break;
+
+					case TAG_ACCEPT:
+						handle_accept(res, flags);
+						break;
+				}
+			}
+		}
+	}
+
+	void uring_reactor::start_send(client_thread_pimpl& ctp) {
+		bool closing;
+
+		{
+			lock_guard<mutex> guard(ctp.send_mutex);
+
+			ctp.send_pending = false;
+			closing = ctp.closing;
+
+			if (!closing && !ctp.send_inflight && !ctp.sendq.empty()) {
+				ctp.send_inflight = true;
+				prep_send(ctp);
+			}
+		}
+
+		if (closing)
+			try_finish(ctp);
+	}
+
+	// The front of sendq mustn't be popped until the completion comes back, as the kernel is
+	// still reading from it.
+	void uring_reactor::prep_send(client_thread_pimpl& ctp) {
+		memset(&ctp.send_msg, 0, sizeof(ctp.send_msg));
+		ctp.send_msg.msg_iov = ctp.send_iov;
+		ctp.send_msg.msg_iovlen = fill_iov(ctp, ctp.send_iov, sizeof(ctp.send_iov) / sizeof(ctp.send_iov[0]));
+
+		ring.prep_sendmsg(ctp.fd, &ctp.send_msg, (uint64_t)(uintptr_t)&ctp | TAG_SEND);
+	}
+
+	void uring_reactor::handle_recv(client_thread_pimpl& ctp, int res, uint32_t flags) {
+		exception_ptr except;
+
+		if (!(flags & IORING_CQE_F_MORE))
+			ctp.recv_armed = false;
+
+		if (res > 0) {
+			auto bid = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+
+			if (!ctp.closing) {
+				try {
+					ctp.on_data(ring.buf(bid), res);
+				} catch (...) {
+					except = current_exception();
+				}
+			}
+
+			ring.recycle_buf(bid);
+		} else if (res == 0 || res == -ECONNRESET)
+			ctp.open = false;
+		else if (res == -ECANCELED) {
+			// set_reading stopped it; it's rearmed below if we've been resumed since
+		} else if (res != -ENOBUFS) // out of buffers is transient, we just rearm
+			except = make_exception_ptr(runtime_error("recv failed (" + to_string(-res) + ")."));
+
+		if (except)
+			ctp.send_close(except);
+
+		if (except || !ctp.open)
+			close_conn(ctp, except);
+		else if (res > 0 && !ctp.read_paused && serv.should_pause(ctp))
+			pause_reads(ctp);
+
+		if (!ctp.recv_armed && !ctp.closing && !ctp.read_paused) {
+			ring.prep_recv_multishot(ctp.fd, (uint64_t)(uintptr_t)&ctp | TAG_RECV);
+			ctp.recv_armed = true;
+		}
+
+		if (ctp.closing)
+			try_finish(ctp);
+	}
+
+	void uring_reactor::handle_send(client_thread_pimpl& ctp, int res) {
+		if (res < 0) {
+			{
+				lock_guard<mutex> guard(ctp.send_mutex);
+
+				ctp.send_inflight = false;
+				drop_sendq(serv, ctp);
+			}
+
+			serv.budget_drained();
+
+			if (res == -EPIPE || res == -ECONNRESET)
+				close_conn(ctp, nullptr);
+			else
+				close_conn(ctp, make_exception_ptr(runtime_error("send failed (" + to_string(-res) + ").")));
+		} else {
+			bool changed;
+
+			{
+				lock_guard<mutex> guard(ctp.send_mutex);
+
+				consume(serv, ctp, res);
+
+				changed = ctp.check_water(ctp.sendq_bytes);
+
+				if (!ctp.closing && !ctp.sendq.empty())
+					prep_send(ctp);
+				else {
+					drop_sendq(serv, ctp);
+					ctp.send_inflight = false;
+				}
+			}
+
+			serv.budget_drained();
+
+			if (changed) {
+				try {
+					ctp.backpressure(false);
+				} catch (...) {
+					close_conn(ctp, current_exception());
+				}
+			}
+		}
+
+		if (ctp.closing)
+			try_finish(ctp);
+	}
+
+	void uring_reactor::handle_accept(int res, uint32_t flags) {
+		if (res >= 0)
+			accept_client(res);
+		else if (res == -EINVAL || res == -ECANCELED) // server::close has shut the listener down
+			return;
+		else if (res != -ECONNABORTED && res != -EINTR)
+			cerr << "accept failed (error " << -res << ")" << endl;
+
+		if (!(flags & IORING_CQE_F_MORE))
+			ring.prep_accept_multishot(listen_sock, TAG_ACCEPT);
+	}
+
+	void uring_reactor::set_reading(client_thread_pimpl& ctp, bool on) {
+		ctp.read_paused = !on;
+
+		if (ctp.closing)
+			return;
+
+		if (!on && ctp.recv_armed)
+			ring.prep_cancel((uint64_t)(uintptr_t)&ctp | TAG_RECV, (uint64_t)(uintptr_t)&ctp | TAG_CANCEL);
+		else if (on && !ctp.recv_armed) {
+			ring.prep_recv_multishot(ctp.fd, (uint64_t)(uintptr_t)&ctp | TAG_RECV);
+			ctp.recv_armed = true;
+		}
+	}
+
+	void uring_reactor::close_conn(client_thread_pimpl& ctp, const exception_ptr& except) {
+		lock_guard<mutex> guard(ctp.send_mutex);
+
+		if (ctp.closing)
+			return;
+
+		ctp.closing = true;
+		ctp.open = false;
+		ctp.close_except = except;
+
+		// completes the outstanding recv, so we know when it's safe to free ctp
+		shutdown(ctp.fd, SHUT_RDWR);
+	}
+
+	void uring_reactor::try_finish(client_thread_pimpl& ctp) {
+		{
+			lock_guard<mutex> guard(ctp.send_mutex);
+
+			if (ctp.recv_armed || ctp.send_inflight || ctp.send_pending)
+				return;
+		}
+
+		auto except = ctp.close_except;
+
+		remove(ctp, except);
+	}
+#endif
+}
+
+#endif
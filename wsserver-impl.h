@@ -7,13 +7,24 @@
 #include "wscpp.h"
 #include <stdint.h>
 #include <map>
+#include <unordered_set>
+#include <list>
+#include <optional>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
 
 #ifdef __MINGW32__
 #include "mingw.thread.h"
+#include "mingw.mutex.h"
 #include "mingw.shared_mutex.h"
+#include "mingw.condition_variable.h"
 #else
 #include <thread>
+#include <mutex>
 #include <shared_mutex>
+#include <condition_variable>
 #endif
 
 #ifdef _WIN32
@@ -21,8 +32,14 @@
 #include <sspi.h>
 #else
 #include <gssapi/gssapi.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #endif
 
+#include "wsuring.h"
+#include "wsexecutor.h"
+#include "wsdeflate.h"
+
 #ifdef _WIN32
 class handle_closer {
 public:
@@ -41,34 +58,275 @@ typedef std::unique_ptr<HANDLE, handle_closer> unique_handle;
 
 namespace ws {
 	class client_thread_pimpl;
+	class reactor;
+
+	// an encoded frame, shared by every connection a broadcast queued it on
+	typedef std::shared_ptr<const std::pmr::string> frame_ptr;
+
+	// A shard's connections, in a slab of slots that are reused as connections come and go, so
+	// adding and removing are O(1) with no search. Slots are allocated in fixed-size chunks, so
+	// a client_thread never moves once it's made. A connection's id is its shard, its slot, and
+	// the slot's generation, which is bumped on reuse so an old id can't find a new connection.
+	//
+	// for_each walks a snapshot of the live slots without holding the lock. A connection removed
+	// while a snapshot's in use is retired onto the newest snapshot rather than destroyed, and as
+	// every snapshot keeps the one after it alive, it goes once all the walks that might see it end.
+	class registry {
+	public:
+		registry(unsigned int shard);
+
+		client_thread& add(void* sock, server& serv, const server_msg_handler& msg_handler,
+						   const server_conn_handler& conn_handler, const server_disconn_handler& disconn_handler);
+		void remove(client_thread& ct);
+		bool find(uint64_t id, const std::function<void(client_thread&)>& func);
+		void find(const std::vector<uint64_t>& ids, const std::function<void(client_thread&)>& func);
+		void for_each(const std::function<void(client_thread&)>& func);
+
+		std::shared_mutex mutex;
+
+	private:
+		struct slot {
+			std::optional<client_thread> ct;
+			uint32_t index;
+			uint32_t generation = 0;
+			uint32_t next_free;
+			std::atomic<bool> live = false; // cleared before ct's destroyed, which is done without holding mutex
+		};
+
+		struct snapshot {
+			snapshot(registry& reg) : reg(reg) { }
+			~snapshot();
+
+			registry& reg;
+			std::vector<slot*> slots;
+			std::vector<slot*> retired; // to be reclaimed once nothing can be walking slots
+			std::shared_ptr<snapshot> next;
+		};
+
+		void reclaim(slot& s);
+		slot* lookup(uint64_t id);
+		std::shared_ptr<snapshot> pin(const std::function<void()>& lookup);
+
+		static const uint32_t CHUNK_SIZE = 256;
+
+		slot& at(uint32_t index) {
+			return chunks[index / CHUNK_SIZE][index % CHUNK_SIZE];
+		}
+
+		unsigned int shard;
+		std::vector<std::unique_ptr<slot[]>> chunks;
+		uint32_t num_slots = 0; // handed out so far, free or not
+		uint32_t free_head = UINT32_MAX;
+		std::weak_ptr<snapshot> newest;
+		std::shared_ptr<snapshot> current; // null if something's been added or removed since
+	};
 
 	class server_pimpl {
 	public:
-		server_pimpl(uint16_t port, int backlog, const server_msg_handler& msg_handler,
+		server_pimpl(server& parent, uint16_t port, int backlog, const server_msg_handler& msg_handler,
 					 const server_conn_handler& conn_handler, const server_disconn_handler& disconn_handler,
-					 const std::string_view& auth_type) :
+					 const std::string_view& auth_type, const server_options& options) :
+			parent(parent),
 			port(port),
 			backlog(backlog),
 			msg_handler(msg_handler),
 			conn_handler(conn_handler),
 			disconn_handler(disconn_handler),
-			auth_type(auth_type)
-		{ }
+			auth_type(auth_type),
+			options(options),
+			reg(0) {
+			mr = options.memory_resource;
+
+			if (!mr) {
+				pool = std::make_unique<std::pmr::synchronized_pool_resource>(std::pmr::pool_options{0, 65536});
+				mr = pool.get();
+			}
 
+			if (options.handler_threads != 0)
+				handlers = std::make_unique<executor>(options.handler_threads);
+		}
+
+		~server_pimpl();
+
+#ifdef _WIN32
+		SOCKET open_listener(bool reuseport);
+#else
+		int open_listener(bool reuseport);
+#endif
+		void create_reactors();
+		void start_reactors();
+		bool should_pause(client_thread_pimpl& ctp);
+		void budget_drained();
+		// what broadcast and publish encode once, and hand to every connection
+		struct shared_frames {
+			std::string_view payload;
+			enum opcode opcode = opcode::invalid;
+			frame_ptr frame;
+			std::string_view key; // for conflation, if not empty
+#ifdef HAVE_ZLIB
+			frame_ptr compressed[16] = {}; // by window bits
+#endif
+		};
+
+		// one thread's share of a broadcast or publish
+		struct fanout_part {
+			shared_frames sf;
+			size_t recipients = 0;
+			std::chrono::steady_clock::time_point first, last;
+		};
+
+		// what publish has for each topic, split by shard so each I/O thread can find its own
+		struct subscribers {
+			size_t count = 0;
+			std::vector<std::unordered_set<client_thread*>> by_shard;
+		};
+
+		void send_shared(client_thread& ct, shared_frames& sf);
+		void send_part(client_thread& ct, fanout_part& part);
+		fanout_stats fan_out(const std::string_view& payload, enum opcode opcode, frame_ptr frame, const std::string_view& key,
+							 size_t count, const std::function<void(fanout_part&, int)>& walk);
+		void for_each(registry& reg, const std::function<void(client_thread&)>& func);
+		registry* shard_registry(size_t shard);
+		fanout_stats broadcast(const std::string_view& payload, enum opcode opcode, frame_ptr frame, const server_filter& filter);
+		fanout_stats publish(const std::string_view& topic, const std::string_view& payload, enum opcode opcode, frame_ptr frame,
+							 const std::string_view& key);
+		void unsubscribe_all(client_thread_pimpl& ctp);
+
+		server& parent;
 		uint16_t port;
 		int backlog;
 		server_msg_handler msg_handler;
 		server_conn_handler conn_handler;
 		server_disconn_handler disconn_handler;
 		std::string auth_type;
+		server_options options;
 #ifdef _WIN32
 		SOCKET sock = INVALID_SOCKET;
 #else
 		int sock = -1;
 #endif
-		std::list<client_thread> client_threads;
-		std::shared_mutex vector_mutex;
+		std::atomic<size_t> buffered_in = 0, buffered_out = 0; // the gauge for memory_budget
+		std::atomic<size_t> connections = 0, paused_reads = 0;
+		std::unique_ptr<std::pmr::synchronized_pool_resource> pool; // if options.memory_resource wasn't given
+		std::pmr::memory_resource* mr; // has to outlive every connection and queued frame
+		std::shared_mutex topics_mutex; // covers each connection's topics too
+		std::map<std::string, subscribers, std::less<>> topics;
+		registry reg;
+		std::unique_ptr<executor> handlers;
+#ifdef __linux__
+		std::vector<std::unique_ptr<reactor>> reactors;
+		unsigned int next_reactor = 0;
+#endif
+		std::mutex stop_mutex;
+		std::condition_variable stop_cv;
+		bool stopping = false;
+	};
+
+#ifdef __linux__
+	class reactor {
+	public:
+		reactor(server_pimpl& serv, bool sharded);
+		virtual ~reactor();
+
+		virtual void start() = 0; // opens the listener if we're sharded, and starts the loop
+		virtual void stop() = 0; // waits for the loop to finish, leaving its connections in place
+		void accept_client(int newsock);
+		void stop_listening();
+		virtual void add(client_thread_pimpl& ctp) = 0;
+
+		// Frame, if set, is the only part, and is queued by reference rather than copied. If key
+		// isn't empty, frame replaces one queued with the same key that hasn't started going out.
+		virtual send_status send(client_thread_pimpl& ctp, const std::string_view* parts, size_t num_parts, const frame_ptr& frame,
+								 const std::string_view& key) = 0;
+		void wake_reads();
+		bool post(std::function<void()> func); // runs func on the loop, or returns false if the loop's finished
+		static bool on_loop_thread(); // true if we're on any reactor's loop
+
+		registry reg;
+
+	protected:
+		void listen();
+		void remove(client_thread_pimpl& ctp, const std::exception_ptr& except);
+		void finish(client_thread_pimpl& ctp, const std::exception_ptr& except);
+		void pause_reads(client_thread_pimpl& ctp);
+		void resume_reads();
+		void run_posted();
+		void close_posted();
+		virtual void set_reading(client_thread_pimpl& ctp, bool on) = 0;
+		virtual void wake() = 0;
+
+		server_pimpl& serv;
+		int listen_sock = -1;
+		std::vector<client_thread_pimpl*> paused; // only touched by the loop
+		std::atomic<bool> resume_wanted = false;
+		std::mutex posted_mutex;
+		std::vector<std::function<void()>> posted;
+		bool posted_closed = false; // under posted_mutex
+		bool sharded;
+		static thread_local reactor* loop; // the one whose loop this thread is running, if any
+	};
+
+	class epoll_reactor : public reactor {
+	public:
+		epoll_reactor(server_pimpl& serv, bool sharded);
+		~epoll_reactor();
+
+		void start() override;
+		void stop() override;
+		void add(client_thread_pimpl& ctp) override;
+		send_status send(client_thread_pimpl& ctp, const std::string_view* parts, size_t num_parts, const frame_ptr& frame,
+						 const std::string_view& key) override;
+
+	private:
+		void run();
+		void wake() override;
+		void set_reading(client_thread_pimpl& ctp, bool on) override;
+		void want_write(client_thread_pimpl& ctp, bool on);
+		void flush(client_thread_pimpl& ctp);
+		void handle_event(client_thread_pimpl& ctp, uint32_t events);
+		void handle_accept();
+
+		int epfd = -1;
+		int wake_fd = -1;
+		std::atomic<bool> stopping = false;
+		std::thread t;
+	};
+#endif
+
+#ifdef HAVE_IO_URING
+	class uring_reactor : public reactor {
+	public:
+		uring_reactor(server_pimpl& serv, bool sharded);
+		~uring_reactor();
+
+		void start() override;
+		void stop() override;
+		void add(client_thread_pimpl& ctp) override;
+		send_status send(client_thread_pimpl& ctp, const std::string_view* parts, size_t num_parts, const frame_ptr& frame,
+						 const std::string_view& key) override;
+
+	private:
+		void run();
+		void wake() override;
+		void set_reading(client_thread_pimpl& ctp, bool on) override;
+		void queue(std::vector<client_thread_pimpl*>& list, client_thread_pimpl& ctp);
+		void start_send(client_thread_pimpl& ctp);
+		void prep_send(client_thread_pimpl& ctp);
+		void handle_recv(client_thread_pimpl& ctp, int res, uint32_t flags);
+		void handle_send(client_thread_pimpl& ctp, int res);
+		void handle_accept(int res, uint32_t flags);
+		void close_conn(client_thread_pimpl& ctp, const std::exception_ptr& except);
+		void try_finish(client_thread_pimpl& ctp);
+
+		uring ring;
+		int wake_fd = -1;
+		uint64_t wake_val;
+		std::mutex pending_mutex;
+		std::vector<client_thread_pimpl*> pending_adds, pending_sends, adds, sends;
+		std::atomic<bool> stopping = false;
+		std::thread t;
 	};
+#endif
 
 	class client_thread_pimpl {
 	public:
@@ -80,28 +338,60 @@ namespace ws {
 				    const server_conn_handler& conn_handler, const server_disconn_handler& disconn_handler) :
 #endif
 			parent(parent),
+			msg_handler(msg_handler),
+			conn_handler(conn_handler),
+			disconn_handler(disconn_handler),
+			recvbuf(serv.impl->mr),
+			parser([&](enum opcode opcode, const std::string_view& payload) { parse_ws_message(opcode, payload); },
+				   nullptr, serv.impl->mr),
 			fd(sock),
-			serv(serv),
-			t([](client_thread_pimpl* ctp, const server_msg_handler& msg_handler,
-			     const server_conn_handler& conn_handler, const server_disconn_handler& disconn_handler) {
-				ctp->msg_handler = msg_handler;
-				ctp->conn_handler = conn_handler;
-				ctp->disconn_handler = disconn_handler;
-				ctp->run();
-			}, this, msg_handler, conn_handler, disconn_handler) { }
+			serv(serv) {
+			if (serv.impl->handlers)
+				handler_strand = std::make_shared<strand>(*serv.impl->handlers);
+
+			serv.impl->connections++;
+
+			parser.validate_utf8(serv.impl->options.validate_utf8);
+			parser.limit(serv.impl->options.limits);
+
+			const auto& stream = serv.impl->options.stream;
+
+			if (stream.begin || stream.chunk || stream.end) {
+				parser.stream([&](enum opcode opcode, const std::string_view& chunk, bool fin) {
+					parse_ws_stream(opcode, chunk, fin);
+				});
+			}
+		}
 
 		~client_thread_pimpl();
 
-		void send_raw(const std::string_view& sv) const;
+		send_status send(const std::string_view& payload, enum opcode opcode, const frame_ptr& frame, const std::string_view& key = {});
+		send_status send(const std::string_view* parts, size_t num_parts, enum opcode opcode);
+		send_status send_raw(const std::string_view& sv);
+		send_status send_raw(const std::string_view* parts, size_t num_parts);
+		send_status send_raw(const frame_ptr& frame, const std::string_view& key = {});
+		send_status send_message(const frame_ptr& frame, const std::string_view& key = {});
+		send_status send_fragment(const std::string_view& payload, enum opcode opcode, bool first, bool fin, bool& compressed);
+		void check_writing();
+		void send_close(const std::exception_ptr& except);
+		void send_last(const std::string_view& sv);
+		bool check_water(size_t queued);
+		void backpressure(bool slow);
 		void handle_handshake(std::map<std::string, std::string>& headers);
 		void internal_server_error(const std::string& s);
 		std::string recv(unsigned int len = 0);
-		std::string recv_full(unsigned int len);
+		size_t recv(char* buf, size_t len);
+		bool recv_ws();
 		void process_http_message(const std::string& mess);
 		void process_http_messages();
-		void parse_ws_message(enum opcode opcode, const std::string& payload);
+		void parse_ws_message(enum opcode opcode, const std::string_view& payload);
+		void parse_ws_stream(enum opcode opcode, const std::string_view& chunk, bool fin);
+		void queue_handler(std::function<void()> func);
 		void websocket_loop();
 		void run();
+		void on_readable();
+		void on_data(char* data, size_t len);
+		void account_in();
 #ifdef _WIN32
 		void get_username(HANDLE token);
 		void impersonate() const;
@@ -111,12 +401,11 @@ namespace ws {
 
 		client_thread& parent;
 		bool open = true;
-		std::thread::id thread_id;
 		server_msg_handler msg_handler;
 		server_conn_handler conn_handler;
 		server_disconn_handler disconn_handler;
-		std::string recvbuf, payloadbuf;
-		enum opcode last_opcode;
+		std::pmr::string recvbuf;
+		frame_parser parser;
 #ifdef _WIN32
 		SOCKET fd;
 		CredHandle cred_handle = {(ULONG_PTR)-1, (ULONG_PTR)-1};
@@ -129,7 +418,34 @@ namespace ws {
 		gss_ctx_id_t ctx_handle = GSS_C_NO_CONTEXT;
 #endif
 		server& serv;
+		uint64_t id = 0; // see registry
 		std::thread t;
+		reactor* r = nullptr;
+		std::mutex send_mutex;
+		std::deque<frame_ptr> sendq;
+		size_t sendq_off = 0, sendq_bytes = 0; // sent bytes of sendq.front(), unsent bytes of sendq
+		uint64_t sendq_popped = 0; // frames taken off sendq so far, so sendq[i] is frame number sendq_popped + i
+		std::map<std::string, uint64_t, std::less<>> sendq_keys; // the number of the last frame queued with each key
+		size_t sendq_holes = 0; // empty frames left in sendq by conflation
+#ifndef _WIN32
+		struct msghdr send_msg; // io_uring's in-flight sendmsg, covering the front of sendq
+		struct iovec send_iov[16];
+#endif
+		bool send_pending = false, send_inflight = false, recv_armed = false, closing = false, slow = false;
+		size_t mem_in = 0; // our part of serv's buffered_in, only touched by whoever's reading
+		std::atomic<bool> read_paused = false;
+		std::exception_ptr close_except;
+		std::shared_ptr<strand> handler_strand;
+		std::exception_ptr handler_except;
+		std::vector<std::string> topics; // what it's subscribed to, under serv's topics_mutex
+#ifdef HAVE_ZLIB
+		std::unique_ptr<deflater> compressor;
+		deflate_params deflate_agreed;
+#endif
+		// Held while a text or binary frame is compressed and queued, so they go out in the order
+		// they were compressed, and so nothing gets into the middle of a message_writer's message.
+		std::mutex msg_mutex;
+		bool writing = false;
 		std::string username, domain_name;
 
 		enum class state_enum {
@@ -18,6 +18,9 @@
 #include <string>
 #include <list>
 #include <map>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
 #include <shared_mutex>
 #include <iostream>
 #include <sys/types.h>
@@ -32,6 +35,8 @@
 #include <fcntl.h>
 #include <string.h>
 #include "wsserver-impl.h"
+#include "wsgather.h"
+#include "wswriter.h"
 #include "b64.h"
 #include "sha1.h"
 #include "gssexcept.h"
@@ -51,6 +56,12 @@ static string lower(string s) {
 
 namespace ws {
 	client_thread_pimpl::~client_thread_pimpl() {
+		serv.impl->unsubscribe_all(*this);
+
+		serv.impl->buffered_in -= mem_in;
+		serv.impl->buffered_out -= sendq_bytes;
+		serv.impl->connections--;
+
 #ifdef _WIN32
 		if ((int)fd != SOCKET_ERROR)
 			closesocket(fd);
@@ -67,7 +78,257 @@ namespace ws {
 			DeleteSecurityContext(&ctx_handle);
 #endif
 
-		t.join();
+		// a connection that removes itself is freed on its own thread, which is about to finish anyway
+		if (t.joinable()) {
+			if (t.get_id() == this_thread::get_id())
+				t.detach();
+			else
+				t.join();
+		}
+	}
+
+	server_pimpl::~server_pimpl() {
+#ifdef __linux__
+		// stop the event loops first, so nothing more gets posted to the handler strands
+		for (auto& r : reactors) {
+			r->stop();
+		}
+#endif
+
+		// then let the queued handlers finish, disconnects included, while the connections
+		// they refer to are still there
+		if (handlers)
+			handlers->stop();
+
+#ifdef __linux__
+		reactors.clear();
+#endif
+	}
+
+	registry::registry(unsigned int shard) : shard(shard) {
+	}
+
+	registry::snapshot::~snapshot() {
+		for (auto s : retired) {
+			reg.reclaim(*s);
+		}
+	}
+
+	client_thread& registry::add(void* sock, server& serv, const server_msg_handler& msg_handler,
+								 const server_conn_handler& conn_handler, const server_disconn_handler& disconn_handler) {
+		shared_ptr<snapshot> stale; // released after the lock, as that might reclaim something
+		unique_lock<shared_mutex> guard(mutex);
+		uint32_t index;
+
+		if (free_head != UINT32_MAX) {
+			index = free_head;
+			free_head = at(index).next_free;
+		} else {
+			if (num_slots == 0x1000000)
+				throw runtime_error("Too many connections.");
+
+			if (num_slots % CHUNK_SIZE == 0)
+				chunks.emplace_back(make_unique<slot[]>(CHUNK_SIZE));
+
+			index = num_slots++;
+		}
+
+		auto& s = at(index);
+
+		try {
+			s.ct.emplace(sock, serv, msg_handler, conn_handler, disconn_handler);
+			s.ct->impl->id = ((uint64_t)s.generation << 32) | ((uint64_t)shard << 24) | index;
+
+			// started once the id's set, so conn_handler sees it, though it can't get to remove until we let go of the lock
+			if (serv.impl->options.engine == server_engine::threads)
+				s.ct->impl->t = thread([](client_thread_pimpl* ctp) { ctp->run(); }, s.ct->impl);
+		} catch (...) {
+			s.ct.reset();
+			s.next_free = free_head;
+			free_head = index;
+			throw;
+		}
+
+		s.index = index;
+		s.live = true;
+
+		stale = move(current);
+
+		return *s.ct;
+	}
+
+	void registry::remove(client_thread& ct) {
+		shared_ptr<snapshot> stale, n;
+		slot* s;
+
+		{
+			unique_lock<shared_mutex> guard(mutex);
+
+			s = &at((uint32_t)(ct.impl->id & 0xffffff));
+			s->live = false;
+
+			stale = move(current);
+			n = newest.lock();
+
+			// Anything else holding the newest snapshot is a walk, or an older snapshot that a walk
+			// has; and any snapshot with s in it is either the newest or keeps it alive.
+			if (n && n.use_count() > (stale == n ? 2 : 1))
+				n->retired.push_back(s);
+			else
+				n.reset();
+		}
+
+		if (!n) { // no walk can see it, so it can go now
+			reclaim(*s);
+			return;
+		}
+
+		// The socket's closed when the connection's freed, but the peer shouldn't have to wait for
+		// the walk to finish to see it's gone. Anything the walk sends now is dropped.
+		lock_guard<std::mutex> guard(ct.impl->send_mutex);
+
+		ct.impl->closing = true;
+
+#ifdef _WIN32
+		shutdown(ct.impl->fd, SD_BOTH);
+#else
+		shutdown(ct.impl->fd, SHUT_RDWR);
+#endif
+	}
+
+	// Not under the lock, as this can block on the connection's thread, or call into a handler
+	// that wants for_each. Chunks never move or go away, so the slot's still where it was.
+	void registry::reclaim(slot& s) {
+		auto& serv = *s.ct->impl->serv.impl;
+
+		s.ct.reset();
+
+		{
+			unique_lock<shared_mutex> guard(mutex);
+
+			s.generation++;
+			s.next_free = free_head;
+			free_head = s.index;
+		}
+
+		// whatever it was holding has gone
+		serv.budget_drained();
+	}
+
+	registry::slot* registry::lookup(uint64_t id) {
+		auto index = (uint32_t)(id & 0xffffff);
+
+		if (index >= num_slots)
+			return nullptr;
+
+		auto& s = at(index);
+
+		return s.live && s.generation == (uint32_t)(id >> 32) ? &s : nullptr;
+	}
+
+	// Holding a snapshot means anything removed from now on is retired rather than freed, so once
+	// lookup's found something under the lock, it's still there after. If there's nothing to hold,
+	// an empty one does, as it's not current, so for_each won't walk it.
+	shared_ptr<registry::snapshot> registry::pin(const function<void()>& lookup) {
+		shared_ptr<snapshot> snap;
+
+		{
+			shared_lock<shared_mutex> guard(mutex);
+
+			snap = newest.lock();
+
+			if (snap) {
+				lookup();
+				return snap;
+			}
+		}
+
+		unique_lock<shared_mutex> guard(mutex);
+
+		snap = newest.lock();
+
+		if (!snap) {
+			snap = make_shared<snapshot>(*this);
+			newest = snap;
+		}
+
+		lookup();
+
+		return snap;
+	}
+
+	// calls func without the lock, like for_each
+	bool registry::find(uint64_t id, const function<void(client_thread&)>& func) {
+		slot* s;
+		auto snap = pin([&]() { s = lookup(id); });
+
+		if (!s || !s->live)
+			return false;
+
+		func(*s->ct);
+
+		return true;
+	}
+
+	// as above, but pinning them all at once
+	void registry::find(const vector<uint64_t>& ids, const function<void(client_thread&)>& func) {
+		vector<slot*> found;
+
+		auto snap = pin([&]() {
+			found.clear();
+
+			for (auto id : ids) {
+				auto s = lookup(id);
+
+				if (s)
+					found.push_back(s);
+			}
+		});
+
+		for (auto s : found) {
+			if (s->live)
+				func(*s->ct);
+		}
+	}
+
+	void registry::for_each(const function<void(client_thread&)>& func) {
+		shared_ptr<snapshot> snap, prev;
+
+		{
+			shared_lock<shared_mutex> guard(mutex);
+
+			snap = current;
+		}
+
+		if (!snap) {
+			unique_lock<shared_mutex> guard(mutex);
+
+			if (!current) {
+				current = make_shared<snapshot>(*this);
+
+				for (uint32_t i = 0; i < num_slots; i++) {
+					auto& s = at(i);
+
+					if (s.live)
+						current->slots.push_back(&s);
+				}
+
+				prev = newest.lock();
+
+				if (prev)
+					prev->next = current;
+
+				newest = current;
+			}
+
+			snap = current;
+		}
+
+		// anything removed since is still there, but skipped
+		for (auto s : snap->slots) {
+			if (s->live)
+				func(*s->ct);
+		}
 	}
 
 	client_thread::~client_thread() {
@@ -78,12 +339,11 @@ namespace ws {
 		try {
 			exception_ptr except;
 
-			thread_id = this_thread::get_id();
-
 			while (open && state == state_enum::http) {
 				recvbuf += recv();
 
 				process_http_messages();
+				account_in();
 			}
 
 			if (open && state == state_enum::websocket) {
@@ -91,24 +351,32 @@ namespace ws {
 					websocket_loop();
 				} catch (...) {
 					except = current_exception();
+					send_close(except);
 				}
 			}
 
-			if (disconn_handler)
-				disconn_handler(parent, except);
+			if (handler_strand) {
+				handler_strand->post([this, except]() {
+					try {
+						if (disconn_handler)
+							disconn_handler(parent, except ? except : handler_except);
+					} catch (const exception& e) {
+						cerr << e.what() << endl;
+					} catch (...) {
+					}
 
-			thread del_thread([&]() {
-				unique_lock<shared_mutex> guard(serv.impl->vector_mutex);
+					// not our own thread, so we can go straight away
+					serv.impl->reg.remove(parent);
+				});
 
-				for (auto it = serv.impl->client_threads.begin(); it != serv.impl->client_threads.end(); it++) {
-					if (it->impl->thread_id == thread_id) {
-						serv.impl->client_threads.erase(it);
-						break;
-					}
-				}
-			});
+				return;
+			}
+
+			if (disconn_handler)
+				disconn_handler(parent, except);
 
-			del_thread.detach();
+			// this can free us, so it's the last thing we do
+			serv.impl->reg.remove(parent);
 		} catch (const exception& e) {
 			cerr << e.what() << endl;
 #ifdef _WIN32
@@ -119,97 +387,333 @@ namespace ws {
 		}
 	}
 
-	void client_thread::send(const string_view& payload, enum opcode opcode) const {
-		char* msg;
-		size_t msglen, len = payload.length();
+	// returns the length of the header, which is never more than 10 bytes
+	static size_t encode_header(char* hdr, uint64_t len, enum opcode opcode, bool compressed, bool fin) {
+		hdr[0] = (char)((fin ? 0x80 : 0) | (compressed ? 0x40 : 0) | ((uint8_t)opcode & 0xf));
+
+		if (len <= 125) {
+			hdr[1] = (char)len;
+			return 2;
+		} else if (len < 0x10000) {
+			hdr[1] = 126;
+			hdr[2] = (len & 0xff00) >> 8;
+			hdr[3] = len & 0xff;
+			return 4;
+		} else {
+			hdr[1] = 127;
+			hdr[2] = (char)((len & 0xff00000000000000) >> 56);
+			hdr[3] = (char)((len & 0xff000000000000) >> 48);
+			hdr[4] = (char)((len & 0xff0000000000) >> 40);
+			hdr[5] = (char)((len & 0xff00000000) >> 32);
+			hdr[6] = (char)((len & 0xff000000) >> 24);
+			hdr[7] = (char)((len & 0xff0000) >> 16);
+			hdr[8] = (char)((len & 0xff00) >> 8);
+			hdr[9] = len & 0xff;
+			return 10;
+		}
+	}
+
+	static frame_ptr encode_frame(pmr::memory_resource* mr, const string_view& payload, enum opcode opcode, bool compressed = false, bool fin = true) {
+		char hdr[10];
+		auto hdrlen = encode_header(hdr, payload.length(), opcode, compressed, fin);
+
+		// the control block comes from mr as well as the buffer, as allocate_shared passes the allocator down
+		auto msg = allocate_shared<pmr::string>(pmr::polymorphic_allocator<pmr::string>(mr));
+
+		msg->reserve(hdrlen + payload.length());
+		msg->append(hdr, hdrlen);
+		msg->append(payload);
+
+		return msg;
+	}
+
+	message::message(const string_view& payload, enum opcode opcode, pmr::memory_resource* mr) :
+		frame(encode_frame(mr ? mr : pmr::get_default_resource(), payload, opcode)) {
+	}
+
+	string_view message::payload() const {
+		if (!frame)
+			return {};
+
+		// skip the header encode_frame put at the front
+		auto len = (uint8_t)(*frame)[1] & 0x7f;
+
+		return string_view(*frame).substr(len == 127 ? 10 : (len == 126 ? 4 : 2));
+	}
+
+	enum opcode message::opcode() const {
+		return frame ? (enum opcode)((*frame)[0] & 0xf) : ws::opcode::invalid;
+	}
+
+#ifdef HAVE_ZLIB
+	static bool should_compress(const deflate_options& opts, size_t len, enum opcode opcode) {
+		return (opcode == opcode::text || opcode == opcode::binary) && len >= opts.min_size;
+	}
+#endif
+
+	send_status client_thread::send(const string_view& payload, enum opcode opcode) const {
+		return impl->send(payload, opcode, nullptr);
+	}
+
+	send_status client_thread::send(const message& msg) const {
+		if (!msg.frame)
+			throw runtime_error("Can't send an empty message.");
+
+		return impl->send(msg.payload(), msg.opcode(), msg.frame);
+	}
+
+	send_status client_thread::send(const message& msg, const string_view& key) const {
+		if (!msg.frame)
+			throw runtime_error("Can't send an empty message.");
+
+		return impl->send(msg.payload(), msg.opcode(), msg.frame, key);
+	}
+
+	// frame is the payload already encoded, uncompressed, if the caller has it
+	send_status client_thread_pimpl::send(const string_view& payload, enum opcode opcode, const frame_ptr& frame,
+										  const string_view& key) {
+		// control frames can go out in the middle of a message_writer's message
+		if ((uint8_t)opcode & 0x8)
+			return send_raw(frame ? frame : encode_frame(serv.impl->mr, payload, opcode));
+
+#ifdef HAVE_ZLIB
+		if (compressor && should_compress(serv.impl->options.deflate, payload.length(), opcode)) {
+			lock_guard<mutex> guard(msg_mutex);
+
+			check_writing();
+
+			// with context takeover, dropping a frame would leave the peer unable to inflate the next
+			return send_raw(encode_frame(serv.impl->mr, compressor->compress(payload), opcode, true),
+							deflate_agreed.server_no_context_takeover ? key : string_view());
+		}
+#endif
+
+		return send_message(frame ? frame : encode_frame(serv.impl->mr, payload, opcode), key);
+	}
+
+	send_status client_thread::send(const string_view* parts, size_t num_parts, enum opcode opcode) const {
+		return impl->send(parts, num_parts, opcode);
+	}
+
+	// One frame, with the parts one after another as its payload. Unless it needs compressing,
+	// the parts are written straight from the caller's buffers, and only copied if the socket
+	// won't take them all at once.
+	send_status client_thread_pimpl::send(const string_view* parts, size_t num_parts, enum opcode opcode) {
+		auto len = total_length(parts, num_parts);
+		bool join = (uint8_t)opcode & 0x8;
+
+#ifdef HAVE_ZLIB
+		join = join || (compressor && should_compress(serv.impl->options.deflate, len, opcode));
+#endif
+
+		if (join) {
+			pmr::string payload(serv.impl->mr);
+
+			payload.reserve(len);
+
+			for (size_t i = 0; i < num_parts; i++) {
+				payload.append(parts[i]);
+			}
+
+			return send(payload, opcode, nullptr);
+		}
+
+		char hdr[10];
+		pmr::vector<string_view> v(serv.impl->mr);
+
+		v.reserve(num_parts + 1);
+		v.emplace_back(hdr, encode_header(hdr, len, opcode, false, true));
+		v.insert(v.end(), parts, parts + num_parts);
+
+		lock_guard<mutex> guard(msg_mutex);
+
+		check_writing();
+
+		return send_raw(v.data(), v.size());
+	}
+
+	void client_thread_pimpl::check_writing() {
+		if (writing)
+			throw runtime_error("Can't send a message while a message_writer is partway through one.");
+	}
+
+	send_status client_thread_pimpl::send_message(const frame_ptr& frame, const string_view& key) {
+		lock_guard<mutex> guard(msg_mutex);
+
+		check_writing();
+
+		return send_raw(frame, key);
+	}
+
+	send_status client_thread_pimpl::send_fragment(const string_view& payload, enum opcode opcode, bool first, bool fin,
+												   bool& compressed) {
+		lock_guard<mutex> guard(msg_mutex);
+
+		if (first) {
+			check_writing();
+
+#ifdef HAVE_ZLIB
+			compressed = compressor && should_compress(serv.impl->options.deflate, payload.length(), opcode);
+#endif
+		}
+
+		frame_ptr frame;
+
+		// only the first frame has the opcode and RSV1; the rest are continuations
+#ifdef HAVE_ZLIB
+		if (compressed)
+			frame = encode_frame(serv.impl->mr, compressor->compress(payload, fin), first ? opcode : opcode::invalid, first, fin);
+		else
+#endif
+			frame = encode_frame(serv.impl->mr, payload, first ? opcode : opcode::invalid, false, fin);
+
+		writing = !fin;
 
-		msglen = len + 2;
+		return send_raw(frame);
+	}
 
-		if (len > 125 && len < 0x10000)
-			msglen += 2;
-		else if (len >= 0x10000)
-			msglen += 8;
+	message_writer::message_writer(client_thread& ct, enum opcode opcode) {
+		impl = new message_writer_pimpl([&ctp = *ct.impl, opcode, compressed = false](const string_view& payload, bool first, bool fin) mutable {
+			return ctp.send_fragment(payload, opcode, first, fin, compressed);
+		});
+	}
 
-		msg = new char[msglen];
+	// Tells the peer why we're dropping them, if it was a protocol error. We're about to close the
+	// socket, so this is best effort: if it can't go straight away, it doesn't go at all.
+	void client_thread_pimpl::send_close(const exception_ptr& except) {
+		string payload;
 
 		try {
-			msg[0] = 0x80 | ((uint8_t)opcode & 0xf);
-
-			if (len <= 125) {
-				msg[1] = (char)len;
-				memcpy(msg + 2, payload.data(), len);
-			} else if (len < 0x10000) {
-				msg[1] = 126;
-				msg[2] = (len & 0xff00) >> 8;
-				msg[3] = len & 0xff;
-				memcpy(msg + 4, payload.data(), len);
-			} else {
-				msg[1] = 127;
-				msg[2] = (char)((len & 0xff00000000000000) >> 56);
-				msg[3] = (char)((len & 0xff000000000000) >> 48);
-				msg[4] = (char)((len & 0xff0000000000) >> 40);
-				msg[5] = (char)((len & 0xff00000000) >> 32);
-				msg[6] = (char)((len & 0xff000000) >> 24);
-				msg[7] = (char)((len & 0xff0000) >> 16);
-				msg[8] = (char)((len & 0xff00) >> 8);
-				msg[9] = len & 0xff;
-				memcpy(msg + 10, payload.data(), len);
-			}
-
-			impl->send_raw(string_view(msg, msglen));
+			rethrow_exception(except);
+		} catch (const protocol_error& e) {
+			payload = string{(char)(e.status >> 8), (char)(e.status & 0xff)};
+			payload += string_view(e.what()).substr(0, 123);
 		} catch (...) {
-			delete[] msg;
-			throw;
+			return;
 		}
 
-		delete[] msg;
+		send_last(*encode_frame(serv.impl->mr, payload, opcode::close));
 	}
 
-	void client_thread_pimpl::send_raw(const std::string_view& sv) const {
+	// best effort at a parting message, as the socket's about to be closed
+	void client_thread_pimpl::send_last(const string_view& sv) {
 #ifdef _WIN32
-		u_long mode = 1;
-
-		if (ioctlsocket(fd, FIONBIO, &mode) != 0)
-			throw runtime_error("ioctlsocket failed (" + to_string(WSAGetLastError()) + ").");
+		try {
+			send_raw(sv);
+		} catch (...) {
+		}
 #else
-		int flags = fcntl(fd, F_GETFL, 0);
+		lock_guard<mutex> guard(send_mutex);
+
+		// don't cut into the middle of a frame that's still queued
+		if (sendq.empty())
+			::send(fd, sv.data(), sv.length(), MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+	}
 
-		if (flags == -1)
-			throw runtime_error("fcntl returned -1");
+	// The threaded engine has no queue to conflate, so key only matters to the reactors.
+	send_status client_thread_pimpl::send_raw(const frame_ptr& frame, const string_view& key) {
+		string_view sv = *frame;
 
-		flags |= O_NONBLOCK;
+#ifdef __linux__
+		if (r)
+			return r->send(*this, &sv, 1, frame, key);
+#endif
+
+		return send_raw(&sv, 1);
+	}
+
+	send_status client_thread_pimpl::send_raw(const std::string_view& sv) {
+		return send_raw(&sv, 1);
+	}
 
-		if (fcntl(fd, F_SETFL, flags) != 0)
-			throw runtime_error("fcntl failed");
+	send_status client_thread_pimpl::send_raw(const string_view* parts, size_t num_parts) {
+#ifdef __linux__
+		if (r)
+			return r->send(*this, parts, num_parts, nullptr, {});
 #endif
 
-		int bytes = send(fd, sv.data(), (int)sv.length(), 0);
+		// The threaded engine has no event loop to flush a queue, so we block until it's all gone,
+		// which throttles the sender by itself. The socket is left in blocking mode for recv.
+		lock_guard<mutex> guard(send_mutex);
+		auto len = total_length(parts, num_parts);
+		size_t done = 0;
+
+		if (closing) // gone, but for_each can still see it
+			return send_status::ok;
 
+		while (done < len) {
 #ifdef _WIN32
-		if (bytes == SOCKET_ERROR) {
-			int err = WSAGetLastError();
+			WSABUF bufs[64];
+			DWORD num = 0, bytes, skip = (DWORD)done;
 
-			if (err != WSAEWOULDBLOCK)
-				throw runtime_error("send failed (" + to_string(err) + ").");
-		}
+			for (size_t i = 0; i < num_parts && num < sizeof(bufs) / sizeof(bufs[0]); i++) {
+				if (skip >= parts[i].length()) {
+					skip -= (DWORD)parts[i].length();
+					continue;
+				}
+
+				bufs[num].buf = (char*)parts[i].data() + skip;
+				bufs[num].len = (ULONG)(parts[i].length() - skip);
+				num++;
+				skip = 0;
+			}
+
+			if (WSASend(fd, bufs, num, &bytes, 0, nullptr, nullptr) == SOCKET_ERROR) {
+				int err = WSAGetLastError();
+
+				if (err == WSAEINTR)
+					continue;
+
+				throw runtime_error("WSASend failed (" + to_string(err) + ").");
+			}
+#else
+			struct iovec iov[64];
+			struct msghdr msg;
 
-		mode = 0;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = gather(iov, sizeof(iov) / sizeof(iov[0]), parts, num_parts, done);
 
-		if (ioctlsocket(fd, FIONBIO, &mode) != 0)
-			throw runtime_error("ioctlsocket failed (" + to_string(WSAGetLastError()) + ").");
+#ifdef MSG_NOSIGNAL
+			auto bytes = sendmsg(fd, &msg, MSG_NOSIGNAL);
 #else
-		if (bytes == -1) {
-			int err = errno;
+			auto bytes = sendmsg(fd, &msg, 0);
+#endif
+
+			if (bytes == -1) {
+				int err = errno;
+
+				if (err == EINTR)
+					continue;
 
-			if (err != EWOULDBLOCK)
 				throw runtime_error("send failed (" + to_string(err) + ").");
+			}
+#endif
+
+			done += bytes;
 		}
 
-		flags &= ~O_NONBLOCK;
+		return send_status::ok;
+	}
 
-		if (fcntl(fd, F_SETFL, flags) != 0)
-			throw runtime_error("fcntl failed");
-#endif
+	bool client_thread_pimpl::check_water(size_t queued) {
+		auto high_water = serv.impl->options.send_high_water;
+
+		if (!slow && queued > high_water) {
+			slow = true;
+			return true;
+		} else if (slow && queued <= high_water / 2) {
+			slow = false;
+			return true;
+		}
+
+		return false;
+	}
+
+	void client_thread_pimpl::backpressure(bool slow) {
+		if (serv.impl->options.backpressure_handler)
+			serv.impl->options.backpressure_handler(parent, slow);
 	}
 
 #ifdef _WIN32
@@ -488,14 +992,57 @@ namespace ws {
 		}
 
 		string resp = b64encode(sha1(headers["Sec-WebSocket-Key"] + MAGIC_STRING));
+		string extensions;
+
+#ifdef HAVE_ZLIB
+		const auto& deflate_opts = serv.impl->options.deflate;
+
+		if (deflate_opts.enabled && headers.count("Sec-WebSocket-Extensions") != 0) {
+			string accepted;
+
+			if (deflate_accept(headers.at("Sec-WebSocket-Extensions"), deflate_opts, deflate_agreed, accepted)) {
+				compressor = make_unique<deflater>(deflate_agreed.server_max_window_bits, deflate_opts.mem_level,
+												   deflate_agreed.server_no_context_takeover, serv.impl->mr);
+				parser.inflate(deflate_agreed.client_max_window_bits, deflate_agreed.client_no_context_takeover);
 
-		send_raw("HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: " + resp + "\r\n\r\n");
+				extensions = "Sec-WebSocket-Extensions: " + accepted + "\r\n";
+			}
+		}
+#endif
+
+		send_raw("HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: " + resp + "\r\n" + extensions + "\r\n");
 
 		state = state_enum::websocket;
-		recvbuf = "";
 
-		if (conn_handler)
-			conn_handler(parent);
+		if (conn_handler) {
+			if (handler_strand)
+				queue_handler([this]() { conn_handler(parent); });
+			else
+				conn_handler(parent);
+		}
+	}
+
+	void client_thread_pimpl::queue_handler(function<void()> func) {
+		handler_strand->post([this, func = move(func)]() {
+			// an earlier handler threw, so the connection is going away
+			if (handler_except)
+				return;
+
+			try {
+				func();
+			} catch (...) {
+				// only ever touched from the strand
+				if (!handler_except)
+					handler_except = current_exception();
+
+				// have the I/O side tear the connection down, as if the handler had thrown there
+#ifdef _WIN32
+				shutdown(fd, SD_BOTH);
+#else
+				shutdown(fd, SHUT_RDWR);
+#endif
+			}
+		});
 	}
 
 	void client_thread_pimpl::internal_server_error(const string& s) {
@@ -507,15 +1054,21 @@ namespace ws {
 
 	string client_thread_pimpl::recv(unsigned int len) {
 		string s;
-		int bytes, err = 0;
 
 		if (len == 0)
 			len = 4096;
 
 		s.resize(len);
+		s.resize(recv(s.data(), len));
+
+		return s;
+	}
+
+	size_t client_thread_pimpl::recv(char* buf, size_t len) {
+		int bytes, err = 0;
 
 		do {
-			bytes = ::recv(fd, s.data(), len, 0);
+			bytes = ::recv(fd, buf, (int)len, 0);
 
 #ifdef _WIN32
 			if (bytes == SOCKET_ERROR)
@@ -524,24 +1077,28 @@ namespace ws {
 #else
 			if (bytes == -1)
 				err = errno;
-		} while (bytes == -1 && err == EWOULDBLOCK);
+		} while (bytes == -1 && err == EWOULDBLOCK && !r);
+
+		// non-blocking socket with nothing to read
+		if (bytes == -1 && err == EWOULDBLOCK)
+			return 0;
 #endif
 
 #ifdef _WIN32
 		if (bytes == 0 || (bytes == SOCKET_ERROR && err == WSAECONNRESET)) {
 			open = false;
-			return "";
+			return 0;
 		} else if (bytes == SOCKET_ERROR)
 			throw runtime_error("recv failed (" + to_string(err) + ").");
 #else
 		if (bytes == 0 || (bytes == -1 && err == ECONNRESET)) {
 			open = false;
-			return "";
+			return 0;
 		} else if (bytes == -1)
 			throw runtime_error("recv failed (" + to_string(err) + ").");
 #endif
 
-		return s.substr(0, bytes);
+		return bytes;
 	}
 
 	void client_thread_pimpl::process_http_message(const string& mess) {
@@ -601,20 +1158,32 @@ namespace ws {
 	void client_thread_pimpl::process_http_messages() {
 		do {
 			size_t dnl = recvbuf.find("\r\n\r\n");
+			auto max_header = serv.impl->options.limits.max_header;
+
+			if (max_header != 0 && (dnl == string::npos ? recvbuf.length() : dnl + 4) > max_header) {
+				send_last("HTTP/1.1 431 Request Header Fields Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+
+				recvbuf.clear();
+				open = false;
+				return;
+			}
 
 			if (dnl == string::npos)
 				return;
 
-			process_http_message(recvbuf.substr(0, dnl + 2));
+			string mess(recvbuf.data(), dnl + 2);
 
-			if (state != state_enum::http)
-				break;
+			recvbuf.erase(0, dnl + 4);
 
-			recvbuf = recvbuf.substr(dnl + 4);
-		} while (true);
+			process_http_message(mess);
+		} while (state == state_enum::http);
 	}
 
-	void client_thread_pimpl::parse_ws_message(enum opcode opcode, const string& payload) {
+	void client_thread_pimpl::parse_ws_message(enum opcode opcode, const string_view& payload) {
+		// anything after a close frame is ignored
+		if (!open)
+			return;
+
 		switch (opcode) {
 			case opcode::close:
 				open = false;
@@ -624,8 +1193,42 @@ namespace ws {
 				parent.send(payload, opcode::pong);
 				break;
 
-			case opcode::text: {
-				if (msg_handler)
+			case opcode::text:
+			case opcode::binary: {
+				const auto& message_handler = serv.impl->options.message_handler;
+				const auto& opcode_msg_handler = serv.impl->options.opcode_msg_handler;
+
+				if (message_handler) {
+					// not from the server's pool, as the handler can keep it for longer than the server lasts
+					message msg(payload, opcode);
+
+					if (handler_strand) {
+						queue_handler([this, &message_handler, msg = move(msg)]() {
+							message_handler(parent, msg);
+						});
+					} else
+						message_handler(parent, move(msg));
+
+					break;
+				}
+
+				if (opcode_msg_handler) {
+					if (handler_strand) {
+						queue_handler([this, &opcode_msg_handler, payload = pmr::string(payload, serv.impl->mr), opcode]() {
+							opcode_msg_handler(parent, payload, opcode);
+						});
+					} else
+						opcode_msg_handler(parent, payload, opcode);
+
+					break;
+				}
+
+				if (!msg_handler || opcode != opcode::text)
+					break;
+
+				if (handler_strand)
+					queue_handler([this, payload = pmr::string(payload, serv.impl->mr)]() { msg_handler(parent, payload); });
+				else
 					msg_handler(parent, payload);
 
 				break;
@@ -636,92 +1239,250 @@ namespace ws {
 		}
 	}
 
-	string client_thread_pimpl::recv_full(unsigned int len) {
-		string s;
+	void client_thread_pimpl::parse_ws_stream(enum opcode opcode, const string_view& chunk, bool fin) {
+		if (!open)
+			return;
 
-		while (true) {
-			s += recv(len - s.length());
+		auto deliver = [this, opcode, fin](const string_view& chunk) {
+			const auto& stream = serv.impl->options.stream;
 
-			if (!open)
-				return "";
+			if (opcode != opcode::invalid && stream.begin)
+				stream.begin(parent, opcode);
 
-			if (s.length() >= len)
-				return s;
-		}
+			if (!chunk.empty() && stream.chunk)
+				stream.chunk(parent, chunk);
+
+			if (fin && stream.end)
+				stream.end(parent);
+		};
+
+		// The chunk has to be copied to queue it, so memory is only bounded if the pool keeps up.
+		if (handler_strand)
+			queue_handler([deliver, chunk = pmr::string(chunk, serv.impl->mr)]() { deliver(chunk); });
+		else
+			deliver(chunk);
 	}
 
 	void client_thread_pimpl::websocket_loop() {
+		// whatever came in after the handshake
+		if (!recvbuf.empty()) {
+			parser.feed(recvbuf);
+			recvbuf.clear();
+		}
+
 		while (open) {
-			string header = recv_full(2);
+			recv_ws();
+		}
+	}
 
-			if (!open)
-				break;
+	// Reads straight into the parser's buffer, so complete messages are never copied. Returns
+	// true if the read filled the buffer, meaning there may be more waiting.
+	bool client_thread_pimpl::recv_ws() {
+		size_t len;
+		auto buf = parser.prepare(len);
+		auto bytes = recv(buf, len);
 
-			bool fin = (header[0] & 0x80) != 0;
-			auto opcode = (enum opcode)(uint8_t)(header[0] & 0xf);
-			bool mask = (header[1] & 0x80) != 0;
-			uint64_t len = header[1] & 0x7f;
+		if (bytes != 0) {
+			parser.commit(bytes);
+			account_in();
+		}
 
-			if (len == 126) {
-				string extlen = recv_full(2);
+		return bytes == len;
+	}
 
-				if (!open)
+	void client_thread_pimpl::on_readable() {
+		if (state == state_enum::websocket) {
+			while (recv_ws() && open) {
+				// give the reactor a chance to stop reading us, if that's put us over memory_budget
+				if (serv.impl->should_pause(*this))
 					break;
+			}
 
-				len = ((uint8_t)extlen[0] << 8) | (uint8_t)extlen[1];
-			} else if (len == 127) {
-				string extlen = recv_full(8);
+			return;
+		}
 
-				if (!open)
-					break;
+		auto s = recv();
 
-				len = (uint8_t)extlen[0];
-				len <<= 8;
-				len |= (uint8_t)extlen[1];
-				len <<= 8;
-				len |= (uint8_t)extlen[2];
-				len <<= 8;
-				len |= (uint8_t)extlen[3];
-				len <<= 8;
-				len |= (uint8_t)extlen[4];
-				len <<= 8;
-				len |= (uint8_t)extlen[5];
-				len <<= 8;
-				len |= (uint8_t)extlen[6];
-				len <<= 8;
-				len |= (uint8_t)extlen[7];
-			}
-
-			string mask_key;
-			if (mask) {
-				mask_key = recv_full(4);
-
-				if (!open)
-					break;
-			}
+		if (open)
+			on_data(s.data(), s.length());
+	}
 
-			string payload = len == 0 ? "" : recv_full((unsigned int)len);
+	void client_thread_pimpl::on_data(char* data, size_t len) {
+		if (state == state_enum::websocket) {
+			parser.feed(data, len);
+			account_in();
+			return;
+		}
 
-			if (!open)
-				break;
+		recvbuf.append(data, len);
 
-			if (mask) {
-				for (unsigned int i = 0; i < payload.length(); i++) {
-					payload[i] ^= mask_key[i % 4];
-				}
-			}
+		process_http_messages();
+
+		if (open && state == state_enum::websocket && !recvbuf.empty()) {
+			parser.feed(recvbuf);
+			recvbuf.clear();
+		}
+
+		account_in();
+	}
+
+	void client_thread_pimpl::account_in() {
+		auto now = recvbuf.length() + parser.buffered();
+
+		if (now >= mem_in) {
+			serv.impl->buffered_in += now - mem_in;
+			mem_in = now;
+			return;
+		}
+
+		serv.impl->buffered_in -= mem_in - now;
+		mem_in = now;
+
+		serv.impl->budget_drained();
+	}
+
+	// Whether a connection should stop being read from, because we're over budget and it's one of
+	// the heavy ones. If nothing's queued to send, reading is the only way anything can drain.
+	bool server_pimpl::should_pause(client_thread_pimpl& ctp) {
+		size_t out = buffered_out, total = buffered_in + out, mine;
+
+		if (options.memory_budget == 0 || total <= options.memory_budget || out == 0)
+			return false;
+
+		{
+			lock_guard<mutex> guard(ctp.send_mutex);
+
+			mine = ctp.mem_in + ctp.sendq_bytes;
+		}
+
+		return mine > total / max(connections.load(), (size_t)1);
+	}
+
+	void server_pimpl::budget_drained() {
+		if (paused_reads == 0)
+			return;
+
+		size_t out = buffered_out;
+
+		if (buffered_in + out > options.memory_budget / 4 * 3 && out != 0)
+			return;
+
+#ifdef __linux__
+		for (auto& r : reactors) {
+			r->wake_reads();
+		}
+#endif
+	}
+
+#ifdef _WIN32
+	SOCKET server_pimpl::open_listener(bool reuseport) {
+		SOCKET s;
+#else
+	int server_pimpl::open_listener(bool reuseport) {
+		int s;
+#endif
+		struct sockaddr_in6 myaddr;
+
+		memset(&myaddr, 0, sizeof(myaddr));
+		myaddr.sin6_family = AF_INET6;
+		myaddr.sin6_port = htons(port);
+		myaddr.sin6_addr = in6addr_any;
+
+		s = socket(AF_INET6, SOCK_STREAM, 0);
 
-			if (!fin) {
-				if (opcode != opcode::invalid)
-					last_opcode = opcode;
+#ifdef _WIN32
+		if (s == INVALID_SOCKET)
+#else
+		if (s == -1)
+#endif
+			throw runtime_error("socket failed.");
+
+		try {
+			int reuseaddr = 1;
+			int ipv6only = 0;
+
+#ifdef _WIN32
+			if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<char*>(&reuseaddr), sizeof(int)) == SOCKET_ERROR)
+				throw sockets_error("setsockopt");
+
+			if (reuseport)
+				throw runtime_error("SO_REUSEPORT is not supported on Windows.");
+
+			if (setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<char*>(&ipv6only), sizeof(int)) == SOCKET_ERROR)
+				throw sockets_error("setsockopt");
+
+			if (::bind(s, reinterpret_cast<sockaddr*>(&myaddr), sizeof(myaddr)) == SOCKET_ERROR)
+				throw sockets_error("bind");
+
+			if (listen(s, backlog) == SOCKET_ERROR)
+				throw sockets_error("listen");
+#else
+			if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<char*>(&reuseaddr), sizeof(int)) == -1)
+				throw sockets_error("setsockopt");
+
+			if (reuseport && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, reinterpret_cast<char*>(&reuseaddr), sizeof(int)) == -1)
+				throw sockets_error("setsockopt");
+
+			if (setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<char*>(&ipv6only), sizeof(int)) == -1)
+				throw sockets_error("setsockopt");
+
+			if (::bind(s, reinterpret_cast<sockaddr*>(&myaddr), sizeof(myaddr)) == -1)
+				throw sockets_error("bind");
+
+			if (listen(s, backlog) == -1)
+				throw sockets_error("listen");
+#endif
+		} catch (...) {
+#ifdef _WIN32
+			closesocket(s);
+#else
+			::close(s);
+#endif
+			throw;
+		}
+
+		return s;
+	}
+
+	void server_pimpl::create_reactors() {
+		if (options.engine == server_engine::threads)
+			return;
 
-				payloadbuf += payload;
-			} else if (payloadbuf != "") {
-				parse_ws_message(last_opcode, payloadbuf + payload);
-				payloadbuf = "";
-			} else
-				parse_ws_message(opcode, payload);
+#ifdef __linux__
+		// the shard number has to fit in a byte of an id, and the server's own registry is shard 0
+		unsigned int num = options.io_threads;
+
+		if (num > 255)
+			throw runtime_error("Too many I/O threads (" + to_string(num) + ").");
+
+		if (num == 0)
+			num = min(max(thread::hardware_concurrency(), 1u), 255u);
+
+		for (unsigned int i = 0; i < num; i++) {
+			if (options.engine == server_engine::epoll)
+				reactors.emplace_back(make_unique<epoll_reactor>(*this, options.sharded));
+			else {
+#ifdef HAVE_IO_URING
+				reactors.emplace_back(make_unique<uring_reactor>(*this, options.sharded));
+#else
+				throw runtime_error("io_uring engine is not supported on this platform.");
+#endif
+			}
 		}
+#else
+		if (options.engine == server_engine::epoll)
+			throw runtime_error("epoll engine is only supported on Linux.");
+		else
+			throw runtime_error("io_uring engine is not supported on this platform.");
+#endif
+	}
+
+	void server_pimpl::start_reactors() {
+#ifdef __linux__
+		for (auto& r : reactors) {
+			r->start();
+		}
+#endif
 	}
 
 	void server::start() {
@@ -733,89 +1494,96 @@ namespace ws {
 #endif
 
 		try {
-			struct sockaddr_in6 myaddr;
+			if (impl->options.sharded) {
+				if (impl->options.engine == server_engine::threads)
+					throw runtime_error("Sharded mode needs the epoll or io_uring engine.");
 
-			memset(&myaddr, 0, sizeof(myaddr));
-			myaddr.sin6_family = AF_INET6;
-			myaddr.sin6_port = htons(impl->port);
-			myaddr.sin6_addr = in6addr_any;
+				// each shard accepts on its own socket, so all we do here is wait
+				impl->start_reactors();
 
-			impl->sock = socket(AF_INET6, SOCK_STREAM, 0);
+				unique_lock<mutex> guard(impl->stop_mutex);
 
-#ifdef _WIN32
-			if (impl->sock == INVALID_SOCKET)
-#else
-			if (impl->sock == -1)
+				impl->stop_cv.wait(guard, [&]() { return impl->stopping; });
+			} else {
+				impl->sock = impl->open_listener(false);
+
+				try {
+					impl->start_reactors();
+
+					auto add_client = [&](auto newsock) {
+#ifdef __linux__
+						if (!impl->reactors.empty()) {
+							impl->reactors[impl->next_reactor++ % impl->reactors.size()]->accept_client(newsock);
+							return;
+						}
 #endif
-				throw runtime_error("socket failed.");
 
-			try {
-				int reuseaddr = 1;
-				int ipv6only = 0;
+						impl->reg.add(&newsock, *this, impl->msg_handler, impl->conn_handler, impl->disconn_handler);
+					};
 
-#ifdef _WIN32
-				if (setsockopt(impl->sock, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<char*>(&reuseaddr), sizeof(int)) == SOCKET_ERROR)
-					throw sockets_error("setsockopt");
+#ifdef HAVE_IO_URING
+					if (impl->options.engine == server_engine::io_uring) {
+						uring ring(16);
 
-				if (setsockopt(impl->sock, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<char*>(&ipv6only), sizeof(int)) == SOCKET_ERROR)
-					throw sockets_error("setsockopt");
+						ring.prep_accept_multishot(impl->sock, 0);
 
-				if (::bind(impl->sock, reinterpret_cast<sockaddr*>(&myaddr), sizeof(myaddr)) == SOCKET_ERROR)
-					throw sockets_error("bind");
+						while (true) {
+							ring.submit(1);
 
-				if (listen(impl->sock, impl->backlog) == SOCKET_ERROR)
-					throw sockets_error("listen");
-#else
-				if (setsockopt(impl->sock, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<char*>(&reuseaddr), sizeof(int)) == -1)
-					throw sockets_error("setsockopt");
+							while (auto cqe = ring.peek_cqe()) {
+								int res = cqe->res;
+								bool more = cqe->flags & IORING_CQE_F_MORE;
+
+								ring.cqe_seen();
 
-				if (setsockopt(impl->sock, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<char*>(&ipv6only), sizeof(int)) == -1)
-					throw sockets_error("setsockopt");
+								if (res < 0)
+									throw runtime_error("accept failed (error " + to_string(-res) + ")");
 
-				if (::bind(impl->sock, reinterpret_cast<sockaddr*>(&myaddr), sizeof(myaddr)) == -1)
-					throw sockets_error("bind");
+								add_client(res);
 
-				if (listen(impl->sock, impl->backlog) == -1)
-					throw sockets_error("listen");
+								if (!more)
+									ring.prep_accept_multishot(impl->sock, 0);
+							}
+						}
+					}
 #endif
 
-				while (true) {
-					struct sockaddr_in6 their_addr;
+					while (true) {
+						struct sockaddr_in6 their_addr;
 #ifdef _WIN32
-					SOCKET newsock;
-					int size = sizeof(their_addr);
+						SOCKET newsock;
+						int size = sizeof(their_addr);
 #else
-					int newsock;
-					socklen_t size = sizeof(their_addr);
+						int newsock;
+						socklen_t size = sizeof(their_addr);
 #endif
 
-					newsock = accept(impl->sock, reinterpret_cast<sockaddr*>(&their_addr), &size);
+						newsock = accept(impl->sock, reinterpret_cast<sockaddr*>(&their_addr), &size);
 
 #ifdef _WIN32
-					if (newsock != INVALID_SOCKET) {
+						if (newsock != INVALID_SOCKET) {
 #else
-					if (newsock != -1) {
+						if (newsock != -1) {
 #endif
-						unique_lock<shared_mutex> guard(impl->vector_mutex);
-
-						impl->client_threads.emplace_back(&newsock, *this, impl->msg_handler, impl->conn_handler, impl->disconn_handler);
-					} else
-						throw sockets_error("accept");
-				}
-			} catch (...) {
+							add_client(newsock);
+						} else
+							throw sockets_error("accept");
+					}
+				} catch (...) {
 #ifdef _WIN32
-				closesocket(impl->sock);
+					closesocket(impl->sock);
 #else
-				::close(impl->sock);
+					::close(impl->sock);
 #endif
-				throw;
-			}
+					throw;
+				}
 
 #ifdef _WIN32
-			closesocket(impl->sock);
+				closesocket(impl->sock);
 #else
-			::close(impl->sock);
+				::close(impl->sock);
 #endif
+			}
 		} catch (...) {
 #ifdef _WIN32
 			WSACleanup();
@@ -828,16 +1596,369 @@ namespace ws {
 #endif
 	}
 
+	// only the connections that have finished their handshake
+	void server_pimpl::for_each(registry& reg, const function<void(client_thread&)>& func) {
+		reg.for_each([&](client_thread& ct) {
+			if (ct.impl->state == client_thread_pimpl::state_enum::websocket)
+				func(ct);
+		});
+	}
+
 	void server::for_each(function<void(client_thread&)> func) {
-		std::shared_lock<std::shared_mutex> guard(impl->vector_mutex);
+		impl->for_each(impl->reg, func);
 
-		for (auto& ct : impl->client_threads) {
-			if (ct.impl->state == client_thread_pimpl::state_enum::websocket)
+#ifdef __linux__
+		for (auto& r : impl->reactors) {
+			impl->for_each(r->reg, func);
+		}
+#endif
+	}
+
+	// null if there's no such shard
+	registry* server_pimpl::shard_registry(size_t shard) {
+		if (shard == 0)
+			return &reg;
+#ifdef __linux__
+		else if (shard <= reactors.size())
+			return &reactors[shard - 1]->reg;
+#endif
+
+		return nullptr;
+	}
+
+	bool server::find(uint64_t id, const function<void(client_thread&)>& func) {
+		auto reg = impl->shard_registry((size_t)((id >> 24) & 0xff));
+		bool found = false;
+
+		if (!reg)
+			return false;
+
+		// like for_each, this only sees connections that have finished their handshake
+		reg->find(id, [&](client_thread& ct) {
+			if (ct.impl->state == client_thread_pimpl::state_enum::websocket) {
+				found = true;
 				func(ct);
+			}
+		});
+
+		return found;
+	}
+
+	fanout_stats server::broadcast(const string_view& payload, enum opcode opcode, const server_filter& filter) {
+		return impl->broadcast(payload, opcode, nullptr, filter);
+	}
+
+	fanout_stats server::broadcast(const message& msg, const server_filter& filter) {
+		if (!msg.frame)
+			throw runtime_error("Can't send an empty message.");
+
+		return impl->broadcast(msg.payload(), msg.opcode(), msg.frame, filter);
+	}
+
+	// Encodes the message the first time a connection needs it in a particular form, and queues
+	// the same frame on everyone after that.
+	void server_pimpl::send_shared(client_thread& ct, shared_frames& sf) {
+		try {
+#ifdef HAVE_ZLIB
+			auto& ctp = *ct.impl;
+
+			if (ctp.compressor && should_compress(options.deflate, sf.payload.length(), sf.opcode)) {
+				// Without context takeover, a message compresses the same way for everyone
+				// with the same window. Otherwise it depends on what the connection sent before.
+				if (!ctp.deflate_agreed.server_no_context_takeover) {
+					ct.send(sf.payload, sf.opcode);
+					return;
+				}
+
+				auto& f = sf.compressed[ctp.deflate_agreed.server_max_window_bits];
+
+				if (!f) {
+					deflater d(ctp.deflate_agreed.server_max_window_bits, options.deflate.mem_level, true, mr);
+
+					f = encode_frame(mr, d.compress(sf.payload), sf.opcode, true);
+				}
+
+				ctp.send_message(f, sf.key);
+				return;
+			}
+#endif
+
+			if (!sf.frame)
+				sf.frame = encode_frame(mr, sf.payload, sf.opcode);
+
+			ct.impl->send_message(sf.frame, sf.key);
+		} catch (const exception& e) {
+			// one broken connection shouldn't stop everyone else getting the message
+			cerr << e.what() << endl;
 		}
 	}
 
+	void server_pimpl::send_part(client_thread& ct, fanout_part& part) {
+		send_shared(ct, part.sf);
+
+		part.last = chrono::steady_clock::now();
+
+		if (part.recipients++ == 0)
+			part.first = part.last;
+	}
+
+	// Calls walk with -1 to go through everything on this thread, or, if there are at least
+	// fanout_threshold recipients, with each reactor's shard number on its own loop.
+	fanout_stats server_pimpl::fan_out(const string_view& payload, enum opcode opcode, frame_ptr frame, const string_view& key,
+									   size_t count, const function<void(fanout_part&, int)>& walk) {
+		vector<fanout_part> parts(1);
+		fanout_stats stats;
+
+#ifdef __linux__
+		// A loop waiting for the others could deadlock with one of them doing the same, so
+		// handlers run on the I/O threads do it all themselves.
+		if (options.fanout_threshold != 0 && count >= options.fanout_threshold && reactors.size() > 1 &&
+			!reactor::on_loop_thread()) {
+			mutex m;
+			condition_variable cv;
+			size_t left = reactors.size();
+			exception_ptr except;
+
+			// encoded here rather than by every thread, though any compressed forms aren't
+			if (!frame)
+				frame = encode_frame(mr, payload, opcode);
+
+			parts.resize(reactors.size());
+
+			for (size_t i = 0; i < reactors.size(); i++) {
+				parts[i].sf = shared_frames{payload, opcode, frame, key};
+
+				auto task = [&, i]() {
+					exception_ptr e;
+
+					try {
+						walk(parts[i], (int)i + 1);
+					} catch (...) {
+						e = current_exception();
+					}
+
+					// notified with the lock held, as m and cv go once the caller sees left reach 0
+					lock_guard<mutex> guard(m);
+
+					if (e && !except)
+						except = e;
+
+					if (--left == 0)
+						cv.notify_one();
+				};
+
+				// if that loop's finished, its share's done here instead
+				if (!reactors[i]->post(task))
+					task();
+			}
+
+			unique_lock<mutex> guard(m);
+
+			cv.wait(guard, [&]() { return left == 0; });
+
+			if (except)
+				rethrow_exception(except);
+
+			stats.threads = (unsigned int)reactors.size();
+		} else
+#endif
+		{
+			parts[0].sf = shared_frames{payload, opcode, frame, key};
+			walk(parts[0], -1);
+		}
+
+		chrono::steady_clock::time_point first, last;
+
+		for (const auto& part : parts) {
+			if (part.recipients == 0)
+				continue;
+
+			if (stats.recipients == 0 || part.first < first)
+				first = part.first;
+
+			if (stats.recipients == 0 || part.last > last)
+				last = part.last;
+
+			stats.recipients += part.recipients;
+		}
+
+		stats.spread = last - first;
+
+		return stats;
+	}
+
+	// frame is the payload already encoded, uncompressed, if the caller has it
+	fanout_stats server_pimpl::broadcast(const string_view& payload, enum opcode opcode, frame_ptr frame, const server_filter& filter) {
+		return fan_out(payload, opcode, frame, {}, connections, [&](fanout_part& part, int shard) {
+			auto visit = [&](client_thread& ct) {
+				if (!filter || filter(ct))
+					send_part(ct, part);
+			};
+
+			if (shard == -1)
+				parent.for_each(visit);
+#ifdef __linux__
+			else
+				for_each(reactors[shard - 1]->reg, visit);
+#endif
+		});
+	}
+
+	void server::subscribe(client_thread& ct, const string_view& topic) {
+		auto shard = (size_t)((ct.impl->id >> 24) & 0xff);
+		unique_lock<shared_mutex> guard(impl->topics_mutex);
+
+		auto it = impl->topics.find(topic);
+
+		if (it == impl->topics.end())
+			it = impl->topics.emplace(topic, server_pimpl::subscribers{}).first;
+
+		auto& subs = it->second;
+
+		if (subs.by_shard.size() <= shard)
+			subs.by_shard.resize(shard + 1);
+
+		if (subs.by_shard[shard].insert(&ct).second) {
+			subs.count++;
+			ct.impl->topics.emplace_back(topic);
+		}
+	}
+
+	void server::unsubscribe(client_thread& ct, const string_view& topic) {
+		auto shard = (size_t)((ct.impl->id >> 24) & 0xff);
+		unique_lock<shared_mutex> guard(impl->topics_mutex);
+
+		auto it = impl->topics.find(topic);
+
+		if (it == impl->topics.end() || it->second.by_shard.size() <= shard || it->second.by_shard[shard].erase(&ct) == 0)
+			return;
+
+		if (--it->second.count == 0)
+			impl->topics.erase(it);
+
+		auto& mine = ct.impl->topics;
+
+		mine.erase(std::find(mine.begin(), mine.end(), topic));
+	}
+
+	// called as the connection's freed, so publish never sees a dangling pointer
+	void server_pimpl::unsubscribe_all(client_thread_pimpl& ctp) {
+		auto shard = (size_t)((ctp.id >> 24) & 0xff);
+		unique_lock<shared_mutex> guard(topics_mutex);
+
+		for (const auto& topic : ctp.topics) {
+			auto it = topics.find(topic);
+
+			it->second.by_shard[shard].erase(&ctp.parent);
+
+			if (--it->second.count == 0)
+				topics.erase(it);
+		}
+
+		ctp.topics.clear();
+	}
+
+	fanout_stats server::publish(const string_view& topic, const string_view& payload, enum opcode opcode) {
+		return impl->publish(topic, payload, opcode, nullptr, {});
+	}
+
+	fanout_stats server::publish(const string_view& topic, const message& msg) {
+		if (!msg.frame)
+			throw runtime_error("Can't send an empty message.");
+
+		return impl->publish(topic, msg.payload(), msg.opcode(), msg.frame, {});
+	}
+
+	fanout_stats server::publish(const string_view& topic, const message& msg, const string_view& key) {
+		if (!msg.frame)
+			throw runtime_error("Can't send an empty message.");
+
+		return impl->publish(topic, msg.payload(), msg.opcode(), msg.frame, key);
+	}
+
+	// The subscribers are copied and the lock let go before anything's queued, as a send can block
+	// with the threads engine, or call a backpressure handler that (un)subscribes. They're found
+	// again by id, so anyone who's gone since is skipped.
+	fanout_stats server_pimpl::publish(const string_view& topic, const string_view& payload, enum opcode opcode, frame_ptr frame,
+									   const string_view& key) {
+		size_t count;
+
+		{
+			shared_lock<shared_mutex> guard(topics_mutex);
+
+			auto it = topics.find(topic);
+
+			if (it == topics.end())
+				return {};
+
+			count = it->second.count;
+		}
+
+		// each thread looks the topic up again, and sees whoever's subscribed by the time it gets there
+		return fan_out(payload, opcode, frame, key, count, [&](fanout_part& part, int shard) {
+			vector<vector<uint64_t>> ids;
+
+			{
+				shared_lock<shared_mutex> guard(topics_mutex);
+
+				auto it = topics.find(topic);
+
+				if (it == topics.end())
+					return;
+
+				const auto& by_shard = it->second.by_shard;
+
+				ids.resize(by_shard.size());
+
+				for (size_t i = 0; i < by_shard.size(); i++) {
+					if (shard != -1 && i != (size_t)shard)
+						continue;
+
+					ids[i].reserve(by_shard[i].size());
+
+					for (auto ct : by_shard[i]) {
+						ids[i].push_back(ct->impl->id);
+					}
+				}
+			}
+
+			for (size_t i = 0; i < ids.size(); i++) {
+				auto reg = shard_registry(i);
+
+				if (reg && !ids[i].empty())
+					reg->find(ids[i], [&](client_thread& ct) { send_part(ct, part); });
+			}
+		});
+	}
+
+	buffer_usage server::buffered() const {
+		buffer_usage u;
+
+		u.inbound = impl->buffered_in;
+		u.outbound = impl->buffered_out;
+		u.paused = impl->paused_reads;
+
+		return u;
+	}
+
 	void server::close() {
+		if (impl->options.sharded) {
+#ifdef __linux__
+			for (auto& r : impl->reactors) {
+				r->stop_listening();
+			}
+#endif
+
+			{
+				lock_guard<mutex> guard(impl->stop_mutex);
+
+				impl->stopping = true;
+			}
+
+			impl->stop_cv.notify_all();
+			return;
+		}
+
 #ifdef _WIN32
 		if (impl->sock != INVALID_SOCKET)
 			closesocket(impl->sock);
@@ -849,8 +1970,16 @@ namespace ws {
 
 	server::server(uint16_t port, int backlog, const server_msg_handler& msg_handler,
 		       const server_conn_handler& conn_handler, const server_disconn_handler& disconn_handler,
-			   const string_view& auth_type) {
-		impl = new server_pimpl(port, backlog, msg_handler, conn_handler, disconn_handler, auth_type);
+			   const string_view& auth_type, const server_options& options) {
+		impl = new server_pimpl(*this, port, backlog, msg_handler, conn_handler, disconn_handler, auth_type, options);
+
+		// made here so the list's complete before anything else can see it, but not started until start
+		try {
+			impl->create_reactors();
+		} catch (...) {
+			delete impl;
+			throw;
+		}
 	}
 
 	server::~server() {
@@ -865,6 +1994,7 @@ namespace ws {
 		auto fd = *(int*)sock;
 #endif
 
+		// with the threads engine, registry::add starts it
 		impl = new client_thread_pimpl(*this, fd, serv, msg_handler, conn_handler, disconn_handler);
 	}
 
@@ -876,6 +2006,10 @@ namespace ws {
 		return impl->domain_name;
 	}
 
+	uint64_t client_thread::id() const {
+		return impl->id;
+	}
+
 #ifdef _WIN32
 	void client_thread_pimpl::impersonate() const {
 		SECURITY_STATUS sec_status;
@@ -0,0 +1,278 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of wscpp.
+ *
+ * wscpp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * wscpp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with wscpp.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifdef HAVE_IO_URING
+
+#include <string>
+#include <stdexcept>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include "wscpp.h"
+#include "wsuring.h"
+
+using namespace std;
+
+namespace ws {
+	uring::uring(unsigned int entries) {
+		struct io_uring_params p;
+
+		memset(&p, 0, sizeof(p));
+		p.flags = IORING_SETUP_CLAMP;
+
+		fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+		if (fd == -1)
+			throw sockets_error("io_uring_setup");
+
+		sq_ring_size = p.sq_off.array + (p.sq_entries * sizeof(unsigned int));
+		cq_ring_size = p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe));
+
+		if (p.features & IORING_FEAT_SINGLE_MMAP) {
+			if (cq_ring_size > sq_ring_size)
+				sq_ring_size = cq_ring_size;
+
+			cq_ring_size = sq_ring_size;
+		}
+
+		try {
+			sq_ptr = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+			if (sq_ptr == MAP_FAILED) {
+				sq_ptr = nullptr;
+				throw sockets_error("mmap");
+			}
+
+			if (p.features & IORING_FEAT_SINGLE_MMAP)
+				cq_ptr = sq_ptr;
+			else {
+				cq_ptr = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+				if (cq_ptr == MAP_FAILED) {
+					cq_ptr = nullptr;
+					throw sockets_error("mmap");
+				}
+			}
+
+			sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+			sqes = (struct io_uring_sqe*)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+			if (sqes == MAP_FAILED) {
+				sqes = nullptr;
+				throw sockets_error("mmap");
+			}
+		} catch (...) {
+			cleanup();
+			throw;
+		}
+
+		sq_head = (unsigned int*)((char*)sq_ptr + p.sq_off.head);
+		sq_tail = (unsigned int*)((char*)sq_ptr + p.sq_off.tail);
+		sq_mask = *(unsigned int*)((char*)sq_ptr + p.sq_off.ring_mask);
+		sq_entries = p.sq_entries;
+
+		// SQEs are always used in order, so the index array is the identity
+		auto array = (unsigned int*)((char*)sq_ptr + p.sq_off.array);
+
+		for (unsigned int i = 0; i < sq_entries; i++) {
+			array[i] = i;
+		}
+
+		sqe_tail = *sq_tail;
+
+		cq_head = (unsigned int*)((char*)cq_ptr + p.cq_off.head);
+		cq_tail = (unsigned int*)((char*)cq_ptr + p.cq_off.tail);
+		cq_mask = *(unsigned int*)((char*)cq_ptr + p.cq_off.ring_mask);
+		cqes = (struct io_uring_cqe*)((char*)cq_ptr + p.cq_off.cqes);
+	}
+
+	uring::~uring() {
+		cleanup();
+	}
+
+	void uring::cleanup() {
+		if (br)
+			munmap(br, br_size);
+
+		delete[] bufs;
+
+		if (sqes)
+			munmap(sqes, sqes_size);
+
+		if (cq_ptr && cq_ptr != sq_ptr)
+			munmap(cq_ptr, cq_ring_size);
+
+		if (sq_ptr)
+			munmap(sq_ptr, sq_ring_size);
+
+		if (fd != -1)
+			close(fd);
+	}
+
+	struct io_uring_sqe* uring::get_sqe() {
+		if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+			submit();
+
+		auto sqe = &sqes[sqe_tail & sq_mask];
+
+		sqe_tail++;
+		memset(sqe, 0, sizeof(*sqe));
+
+		return sqe;
+	}
+
+	void uring::submit(unsigned int wait_nr) {
+		__atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+
+		unsigned int to_submit = sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+
+		if (to_submit == 0 && wait_nr == 0)
+			return;
+
+		do {
+			if (syscall(__NR_io_uring_enter, fd, to_submit, wait_nr, wait_nr != 0 ? IORING_ENTER_GETEVENTS : 0,
+						nullptr, 0) != -1) {
+				return;
+			}
+		} while (errno == EINTR);
+
+		// EBUSY means the CQ is full, which the caller fixes by reaping
+		if (errno != EBUSY)
+			throw sockets_error("io_uring_enter");
+	}
+
+	struct io_uring_cqe* uring::peek_cqe() {
+		unsigned int head = *cq_head;
+
+		if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+			return nullptr;
+
+		return &cqes[head & cq_mask];
+	}
+
+	void uring::cqe_seen() {
+		__atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+	}
+
+	void uring::setup_buf_ring(uint16_t bgid, unsigned int count, unsigned int size) {
+		struct io_uring_buf_reg reg;
+
+		br_size = count * sizeof(struct io_uring_buf);
+
+		br = (struct io_uring_buf_ring*)mmap(nullptr, br_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+		if (br == MAP_FAILED) {
+			br = nullptr;
+			throw sockets_error("mmap");
+		}
+
+		memset(&reg, 0, sizeof(reg));
+		reg.ring_addr = (uint64_t)(uintptr_t)br;
+		reg.ring_entries = count;
+		reg.bgid = bgid;
+
+		if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+			throw sockets_error("io_uring_register");
+
+		br_bgid = bgid;
+		br_mask = count - 1;
+		buf_size = size;
+		bufs = new char[(size_t)count * size];
+
+		for (unsigned int i = 0; i < count; i++) {
+			recycle_buf((uint16_t)i);
+		}
+	}
+
+	char* uring::buf(uint16_t bid) const {
+		return bufs + ((size_t)bid * buf_size);
+	}
+
+	void uring::recycle_buf(uint16_t bid) {
+		// not br->bufs, as __DECLARE_FLEX_ARRAY puts it at the wrong offset in C++
+		auto& b = ((struct io_uring_buf*)br)[br_tail & br_mask];
+
+		b.addr = (uint64_t)(uintptr_t)buf(bid);
+		b.len = buf_size;
+		b.bid = bid;
+
+		br_tail++;
+		__atomic_store_n(&br->tail, br_tail, __ATOMIC_RELEASE);
+	}
+
+	struct io_uring_sqe* uring::prep_accept_multishot(int sock, uint64_t user_data) {
+		auto sqe = get_sqe();
+
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->fd = sock;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->user_data = user_data;
+
+		return sqe;
+	}
+
+	struct io_uring_sqe* uring::prep_recv_multishot(int sock, uint64_t user_data) {
+		auto sqe = get_sqe();
+
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = sock;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = br_bgid;
+		sqe->user_data = user_data;
+
+		return sqe;
+	}
+
+	struct io_uring_sqe* uring::prep_sendmsg(int sock, const struct msghdr* msg, uint64_t user_data) {
+		auto sqe = get_sqe();
+
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = sock;
+		sqe->addr = (uint64_t)(uintptr_t)msg;
+		sqe->len = 1;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		sqe->user_data = user_data;
+
+		return sqe;
+	}
+
+	struct io_uring_sqe* uring::prep_read(int fd, void* data, size_t len, uint64_t user_data) {
+		auto sqe = get_sqe();
+
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = fd;
+		sqe->addr = (uint64_t)(uintptr_t)data;
+		sqe->len = (uint32_t)len;
+		sqe->user_data = user_data;
+
+		return sqe;
+	}
+
+	// target is the user_data of the request to cancel
+	struct io_uring_sqe* uring::prep_cancel(uint64_t target, uint64_t user_data) {
+		auto sqe = get_sqe();
+
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = target;
+		sqe->user_data = user_data;
+
+		return sqe;
+	}
+}
+
+#endif
@@ -0,0 +1,64 @@
+#pragma once
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace ws {
+	// Minimal io_uring wrapper, talking to the kernel directly so we don't need liburing.
+	// Not thread-safe: the SQ and CQ must only be touched by one thread at a time.
+	class uring {
+	public:
+		uring(unsigned int entries);
+		~uring();
+
+		struct io_uring_sqe* get_sqe();
+		void submit(unsigned int wait_nr = 0);
+		struct io_uring_cqe* peek_cqe();
+		void cqe_seen();
+
+		void setup_buf_ring(uint16_t bgid, unsigned int count, unsigned int size);
+		char* buf(uint16_t bid) const;
+		void recycle_buf(uint16_t bid);
+
+		struct io_uring_sqe* prep_accept_multishot(int sock, uint64_t user_data);
+		struct io_uring_sqe* prep_recv_multishot(int sock, uint64_t user_data);
+		struct io_uring_sqe* prep_sendmsg(int sock, const struct msghdr* msg, uint64_t user_data);
+		struct io_uring_sqe* prep_read(int fd, void* data, size_t len, uint64_t user_data);
+		struct io_uring_sqe* prep_cancel(uint64_t target, uint64_t user_data);
+
+	private:
+		void cleanup();
+
+		int fd = -1;
+
+		void* sq_ptr = nullptr;
+		void* cq_ptr = nullptr;
+		size_t sq_ring_size, cq_ring_size;
+		struct io_uring_sqe* sqes = nullptr;
+		size_t sqes_size;
+
+		unsigned int* sq_head;
+		unsigned int* sq_tail;
+		unsigned int sq_mask;
+		unsigned int sq_entries;
+		unsigned int sqe_tail = 0;
+
+		unsigned int* cq_head;
+		unsigned int* cq_tail;
+		unsigned int cq_mask;
+		struct io_uring_cqe* cqes;
+
+		struct io_uring_buf_ring* br = nullptr;
+		size_t br_size;
+		uint16_t br_bgid;
+		unsigned int br_mask;
+		uint16_t br_tail = 0;
+		char* bufs = nullptr;
+		unsigned int buf_size;
+	};
+}
+
+#endif
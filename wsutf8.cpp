@@ -0,0 +1,401 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of wscpp.
+ *
+ * wscpp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * wscpp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with wscpp.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <string.h>
+#include "wsutf8.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define UTF8_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(UTF8_X86) && (defined(__GNUC__) || defined(__clang__))
+#define TARGET(t) __attribute__((target(t)))
+#else
+#define TARGET(t)
+#endif
+
+using namespace std;
+
+// Returns how many bytes from the start are known to be valid, stopping short of a character
+// that runs off the end, or -1 if something's wrong. Input always starts on a character boundary.
+typedef ptrdiff_t (*validate_func)(const char* data, size_t len);
+
+namespace ws {
+	// how many bytes at the end of data[0, len) belong to a character that isn't finished
+	static size_t incomplete_tail(const char* data, size_t len) {
+		for (size_t i = 1; i <= 3 && i <= len; i++) {
+			auto c = (uint8_t)data[len - i];
+
+			if (c < 0x80)
+				return 0;
+
+			if (c >= 0xc0) {
+				size_t seq = c >= 0xf0 ? 4 : (c >= 0xe0 ? 3 : 2);
+
+				return seq > i ? i : 0;
+			}
+		}
+
+		return 0;
+	}
+
+	static bool step(unsigned int& need, uint8_t& lo, uint8_t& hi, uint8_t c) {
+		if (need == 0) {
+			if (c < 0x80)
+				return true;
+
+			lo = 0x80;
+			hi = 0xbf;
+
+			if (c >= 0xc2 && c <= 0xdf)
+				need = 1;
+			else if (c >= 0xe0 && c <= 0xef) {
+				need = 2;
+
+				if (c == 0xe0) // overlong
+					lo = 0xa0;
+				else if (c == 0xed) // surrogates
+					hi = 0x9f;
+			} else if (c >= 0xf0 && c <= 0xf4) {
+				need = 3;
+
+				if (c == 0xf0) // overlong
+					lo = 0x90;
+				else if (c == 0xf4) // above U+10FFFF
+					hi = 0x8f;
+			} else
+				return false;
+
+			return true;
+		}
+
+		if (c < lo || c > hi)
+			return false;
+
+		need--;
+		lo = 0x80;
+		hi = 0xbf;
+
+		return true;
+	}
+
+	static bool scan(unsigned int& need, uint8_t& lo, uint8_t& hi, const char* data, size_t len) {
+		while (len > 0) {
+			// skip through ASCII eight bytes at a time
+			if (need == 0 && len >= sizeof(uint64_t)) {
+				uint64_t v;
+
+				memcpy(&v, data, sizeof(v));
+
+				if (!(v & 0x8080808080808080ull)) {
+					data += sizeof(uint64_t);
+					len -= sizeof(uint64_t);
+					continue;
+				}
+			}
+
+			if (!step(need, lo, hi, (uint8_t)*data))
+				return false;
+
+			data++;
+			len--;
+		}
+
+		return true;
+	}
+
+	static ptrdiff_t validate_scalar(const char* data, size_t len) {
+		unsigned int need = 0;
+		uint8_t lo = 0x80, hi = 0xbf;
+		size_t end = len - incomplete_tail(data, len);
+
+		if (!scan(need, lo, hi, data, end) || need != 0)
+			return -1;
+
+		return (ptrdiff_t)end;
+	}
+
+#ifdef UTF8_X86
+	// The lookup algorithm from Keiser and Lemire, "Validating UTF-8 In Less Than One Instruction
+	// Per Byte". Every error shows up as a bit in the AND of three table lookups, indexed by the
+	// high and low nibbles of the previous byte and the high nibble of this one, plus a check
+	// that the third and fourth bytes of long characters are continuations.
+
+	static const uint8_t TOO_SHORT = 1 << 0;
+	static const uint8_t TOO_LONG = 1 << 1;
+	static const uint8_t OVERLONG_3 = 1 << 2;
+	static const uint8_t TOO_LARGE = 1 << 3;
+	static const uint8_t SURROGATE = 1 << 4;
+	static const uint8_t OVERLONG_2 = 1 << 5;
+	static const uint8_t TOO_LARGE_1000 = 1 << 6;
+	static const uint8_t OVERLONG_4 = 1 << 6;
+	static const uint8_t TWO_CONTS = 1 << 7;
+	static const uint8_t CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
+
+	alignas(16) static const uint8_t byte_1_high[16] = {
+		TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+		TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+		TOO_SHORT | OVERLONG_2,
+		TOO_SHORT,
+		TOO_SHORT | OVERLONG_3 | SURROGATE,
+		TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+	};
+
+	alignas(16) static const uint8_t byte_1_low[16] = {
+		CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+		CARRY | OVERLONG_2,
+		CARRY,
+		CARRY,
+		CARRY | TOO_LARGE,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000
+	};
+
+	alignas(16) static const uint8_t byte_2_high[16] = {
+		TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+		TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+	};
+
+	// anything above these in the last three bytes starts a character that needs more bytes
+	alignas(16) static const uint8_t incomplete_max[32] = {
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xef, 0xdf, 0xbf
+	};
+
+	TARGET("ssse3")
+	static __m128i check_block_ssse3(__m128i input, __m128i prev_input) {
+		auto nibble = _mm_set1_epi8(0x0f);
+		auto prev1 = _mm_alignr_epi8(input, prev_input, 15);
+
+		auto b1h = _mm_shuffle_epi8(_mm_load_si128((const __m128i*)byte_1_high), _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+		auto b1l = _mm_shuffle_epi8(_mm_load_si128((const __m128i*)byte_1_low), _mm_and_si128(prev1, nibble));
+		auto b2h = _mm_shuffle_epi8(_mm_load_si128((const __m128i*)byte_2_high), _mm_and_si128(_mm_srli_epi16(input, 4), nibble));
+		auto special = _mm_and_si128(_mm_and_si128(b1h, b1l), b2h);
+
+		auto prev2 = _mm_alignr_epi8(input, prev_input, 14);
+		auto prev3 = _mm_alignr_epi8(input, prev_input, 13);
+		auto third = _mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xe0 - 0x80)));
+		auto fourth = _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xf0 - 0x80)));
+		auto must23 = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8((char)0x80));
+
+		return _mm_xor_si128(must23, special);
+	}
+
+	TARGET("ssse3")
+	static ptrdiff_t validate_ssse3(const char* data, size_t len) {
+		auto error = _mm_setzero_si128();
+		auto prev_input = _mm_setzero_si128();
+		auto prev_incomplete = _mm_setzero_si128();
+		auto max = _mm_loadu_si128((const __m128i*)(incomplete_max + 16));
+		size_t pos = 0;
+
+		while (len - pos >= sizeof(__m128i)) {
+			auto input = _mm_loadu_si128((const __m128i*)(data + pos));
+
+			if (_mm_movemask_epi8(input) == 0) // all ASCII, so only a character left hanging matters
+				error = _mm_or_si128(error, prev_incomplete);
+			else {
+				error = _mm_or_si128(error, check_block_ssse3(input, prev_input));
+				prev_incomplete = _mm_subs_epu8(input, max);
+			}
+
+			prev_input = input;
+			pos += sizeof(__m128i);
+		}
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) != 0xffff)
+			return -1;
+
+		// Back up to the start of any character the last block cut off, which hasn't been
+		// checked against what follows, and finish off with the scalar code.
+		pos -= incomplete_tail(data, pos);
+
+		auto ret = validate_scalar(data + pos, len - pos);
+
+		return ret == -1 ? -1 : (ptrdiff_t)pos + ret;
+	}
+
+	TARGET("avx2")
+	static __m256i prev_bytes_avx2(__m256i input, __m256i prev_input, int n) {
+		// alignr only works within each 128-bit lane, so line up the lanes first
+		auto shifted = _mm256_permute2x128_si256(prev_input, input, 0x21);
+
+		switch (n) {
+			case 1:
+				return _mm256_alignr_epi8(input, shifted, 15);
+			case 2:
+				return _mm256_alignr_epi8(input, shifted, 14);
+			default:
+				return _mm256_alignr_epi8(input, shifted, 13);
+		}
+	}
+
+	TARGET("avx2")
+	static __m256i check_block_avx2(__m256i input, __m256i prev_input) {
+		auto nibble = _mm256_set1_epi8(0x0f);
+		auto prev1 = prev_bytes_avx2(input, prev_input, 1);
+
+		auto b1h = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)byte_1_high)),
+									   _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+		auto b1l = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)byte_1_low)),
+									   _mm256_and_si256(prev1, nibble));
+		auto b2h = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)byte_2_high)),
+									   _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble));
+		auto special = _mm256_and_si256(_mm256_and_si256(b1h, b1l), b2h);
+
+		auto prev2 = prev_bytes_avx2(input, prev_input, 2);
+		auto prev3 = prev_bytes_avx2(input, prev_input, 3);
+		auto third = _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xe0 - 0x80)));
+		auto fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xf0 - 0x80)));
+		auto must23 = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8((char)0x80));
+
+		return _mm256_xor_si256(must23, special);
+	}
+
+	TARGET("avx2")
+	static ptrdiff_t validate_avx2(const char* data, size_t len) {
+		auto error = _mm256_setzero_si256();
+		auto prev_input = _mm256_setzero_si256();
+		auto prev_incomplete = _mm256_setzero_si256();
+		auto max = _mm256_loadu_si256((const __m256i*)incomplete_max);
+		size_t pos = 0;
+
+		while (len - pos >= sizeof(__m256i)) {
+			auto input = _mm256_loadu_si256((const __m256i*)(data + pos));
+
+			if (_mm256_movemask_epi8(input) == 0)
+				error = _mm256_or_si256(error, prev_incomplete);
+			else {
+				error = _mm256_or_si256(error, check_block_avx2(input, prev_input));
+				prev_incomplete = _mm256_subs_epu8(input, max);
+			}
+
+			prev_input = input;
+			pos += sizeof(__m256i);
+		}
+
+		if (!_mm256_testz_si256(error, error))
+			return -1;
+
+		pos -= incomplete_tail(data, pos);
+
+		auto ret = validate_scalar(data + pos, len - pos);
+
+		return ret == -1 ? -1 : (ptrdiff_t)pos + ret;
+	}
+
+#ifdef _MSC_VER
+	static bool os_saves_ymm() {
+		int regs[4];
+
+		__cpuid(regs, 1);
+
+		// OSXSAVE
+		if (!(regs[2] & (1 << 27)))
+			return false;
+
+		return (_xgetbv(0) & 0x6) == 0x6;
+	}
+#endif
+
+	static validate_func pick_validate() {
+#ifdef _MSC_VER
+		int regs[4];
+
+		__cpuid(regs, 0);
+
+		if (regs[0] >= 7) {
+			__cpuidex(regs, 7, 0);
+
+			if ((regs[1] & (1 << 5)) && os_saves_ymm())
+				return validate_avx2;
+		}
+
+		__cpuid(regs, 1);
+
+		if (regs[2] & (1 << 9))
+			return validate_ssse3;
+#else
+		__builtin_cpu_init();
+
+		if (__builtin_cpu_supports("avx2"))
+			return validate_avx2;
+
+		if (__builtin_cpu_supports("ssse3"))
+			return validate_ssse3;
+#endif
+
+		return validate_scalar;
+	}
+#endif
+
+	bool utf8_validator::feed(const char* data, size_t len) {
+		// finish off any character left over from last time
+		while (need > 0 && len > 0) {
+			if (!step(need, lo, hi, (uint8_t)*data))
+				return false;
+
+			data++;
+			len--;
+		}
+
+		if (len == 0)
+			return true;
+
+		ptrdiff_t done;
+
+#ifdef UTF8_X86
+		static const validate_func func = pick_validate();
+
+		// not worth going through the vector kernels for a few bytes
+		done = len < 32 ? validate_scalar(data, len) : func(data, len);
+#else
+		done = validate_scalar(data, len);
+#endif
+
+		if (done == -1)
+			return false;
+
+		// all that's left is the start of a character, which the next fragment should finish
+		return scan(need, lo, hi, data + done, len - (size_t)done);
+	}
+
+	bool utf8_validator::finish() {
+		bool ok = need == 0;
+
+		need = 0;
+
+		return ok;
+	}
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace ws {
+	// Incremental UTF-8 validator, so a text message can be checked a fragment at a time, with
+	// a character split across fragments carried over to the next feed.
+	class utf8_validator {
+	public:
+		bool feed(const char* data, size_t len); // false as soon as the input can't be valid
+		bool finish(); // false if the message stopped in the middle of a character; resets either way
+
+	private:
+		unsigned int need = 0; // continuation bytes still to come
+		uint8_t lo = 0x80, hi = 0xbf; // allowed range for the next one
+	};
+}
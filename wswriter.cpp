@@ -0,0 +1,60 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of wscpp.
+ *
+ * wscpp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * wscpp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with wscpp.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdexcept>
+#include "wswriter.h"
+
+using namespace std;
+
+namespace ws {
+	message_writer::~message_writer() {
+		// a destructor can't throw, and if the connection's gone there's nobody to tell anyway
+		try {
+			if (impl->started && !impl->finished)
+				finish();
+		} catch (...) {
+		}
+
+		delete impl;
+	}
+
+	send_status message_writer::write(const string_view& data) {
+		if (impl->finished)
+			throw runtime_error("Message has already been finished.");
+
+		// an empty fragment would be legal, but pointless
+		if (data.empty())
+			return send_status::ok;
+
+		auto ret = impl->send(data, !impl->started, false);
+
+		impl->started = true;
+
+		return ret;
+	}
+
+	send_status message_writer::finish(const string_view& data) {
+		if (impl->finished)
+			throw runtime_error("Message has already been finished.");
+
+		auto ret = impl->send(data, !impl->started, true);
+
+		impl->started = impl->finished = true;
+
+		return ret;
+	}
+}
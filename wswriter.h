@@ -0,0 +1,18 @@
+#pragma once
+
+#include "wscpp.h"
+#include <functional>
+
+namespace ws {
+	// sends one fragment: first is set for the frame that carries the opcode, fin for the last
+	typedef std::function<send_status(const std::string_view& payload, bool first, bool fin)> fragment_sender;
+
+	class message_writer_pimpl {
+	public:
+		message_writer_pimpl(const fragment_sender& send) : send(send) {
+		}
+
+		fragment_sender send;
+		bool started = false, finished = false;
+	};
+}